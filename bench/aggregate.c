@@ -0,0 +1,134 @@
+// Reading many controllers through the aggregate node.
+
+#include "bench.h"
+
+#include "mux.h"
+#include "report.h"
+
+#include <err.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+
+// bench mux [-p] controllers [rate [seconds]]
+//
+// Read the input reports of fake controllers streaming at the given rate, out
+// of phase with each other, through the aggregate node, or with -p, through
+// each controller's own node after polling. Report the system calls the reader
+// makes per second: a read of the aggregate node per wakeup, or a poll and a
+// read of every ready node, where the aggregate node stands in for poll().
+// Also report the reader's CPU time and report-to-reader latency.
+
+struct mux_reader {
+    struct fakes* fs;
+    int per_node;
+    long syscalls, reports;
+    double cpu;
+    double* latency;
+    size_t samples, max_samples;
+};
+
+static void*
+mux_reader_run(void* r_void)
+{
+    struct mux_reader* r = r_void;
+    unsigned char buf[4096];
+    size_t size;
+    while (size = sizeof buf, mux_read(0, buf, &size)) {
+        r->syscalls++;
+        double t = now();
+        struct btsixa_mux_record h;
+        for (size_t i = 0; i + sizeof h <= size;
+                i += sizeof h + (h.size + BTSIXA_MUX_ALIGN - 1) /
+                                BTSIXA_MUX_ALIGN * BTSIXA_MUX_ALIGN) {
+            memcpy(&h, buf+i, sizeof h);
+            unsigned char* report = buf+i+sizeof h;
+            size_t n = h.size;
+            unsigned char own[DEVICE_MAX_REPORT_SIZE];
+            if (r->per_node && n) {
+                n = sizeof own;
+                device_read(&r->fs->f[h.unit].d, 1, own, &n);
+                r->syscalls++;
+                report = own;
+                t = now();
+            }
+            if (n < FAKE_SENT_OFFSET + sizeof(double))
+                continue;
+            double sent;
+            memcpy(&sent, report+FAKE_SENT_OFFSET, sizeof sent);
+            if (r->samples < r->max_samples)
+                r->latency[r->samples++] = t - sent;
+            r->reports++;
+        }
+    }
+    r->cpu = cpu(RUSAGE_THREAD);
+    return NULL;
+}
+
+int
+bench_mux(int argc, char* argv[])
+{
+    int per_node = 0;
+    if (argc >= 1 && !strcmp(argv[0], "-p")) {
+        per_node = 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 1 || argc > 3)
+        return 0;
+    struct fakes fs = { NULL, atoi(argv[0]), 0, 0.001,
+                        argc > 1 ? atoi(argv[1]) : 100 };
+    double seconds = argc > 2 ? atof(argv[2]) : 5;
+    if (fs.n < 1 || fs.rate < 1 || seconds <= 0)
+        return 0;
+    fs.spread = 1;
+
+    fs.f = fake_create(fs.n);
+    pthread_t ctrl_thread, reader_thread;
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    for (int i = 0; i < fs.n; i++) {
+        fs.f[i].d.unit = i;
+        device_start(&fs.f[i].d);
+        mux_attach(&fs.f[i].d);
+    }
+    struct mux_reader r = { &fs, per_node };
+    r.max_samples = seconds * fs.rate * fs.n + 1;
+    r.latency = malloc(r.max_samples * sizeof *r.latency);
+    if (!r.latency)
+        err(1, "malloc() failed");
+    // The aggregate node also keeps the controllers reporting when per node.
+    if (!mux_open())
+        errx(1, "mux_open() failed");
+    for (int i = 0; i < fs.n && per_node; i++)
+        device_open(&fs.f[i].d);
+    if (pthread_create(&reader_thread, NULL, mux_reader_run, &r))
+        errx(1, "pthread_create() failed");
+
+    usleep(seconds * 1000000);
+    mux_close(); // wakes up the reader
+    if (pthread_join(reader_thread, NULL))
+        errx(1, "pthread_join() failed");
+    for (int i = 0; i < fs.n; i++) {
+        mux_detach(&fs.f[i].d);
+        device_disconnect(&fs.f[i].d);
+    }
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+    for (int i = 0; i < fs.n; i++)
+        device_stop(&fs.f[i].d);
+
+    printf("%s, %d controllers at %d/s: %.0lf syscalls/s, "
+           "%.2lf reports/syscall, %.1lf us CPU per report\n",
+           per_node ? "per-node poll" : "aggregate node", fs.n, fs.rate,
+           r.syscalls / seconds, (double)r.reports / r.syscalls,
+           1e6*r.cpu / r.reports);
+    print_latency("report to reader", r.latency, r.samples);
+    free(r.latency);
+    return 1;
+}
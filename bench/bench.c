@@ -0,0 +1,154 @@
+// Benchmarks that drive the device layer in-process over local socket pairs
+// standing in for the L2CAP channels, so no gamepad is needed. GNUmakefile
+// builds them on Linux too, all but the event loop.
+
+#include "bench.h"
+
+#include "host.h"
+#include "logger.h"
+#include "sixaxis.h"
+#include "timer.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/resource.h>
+
+
+int dflag;
+bdaddr_t bdaddr;
+int timeout;
+int queue_depth = 1;
+int report_cache = 1;
+int change_threshold = -1;
+int output_rate;
+int delivery_rate;
+int stall_gap;
+int stall_action;
+
+
+double
+now()
+{
+    struct timespec t;
+    W(clock_gettime(CLOCK_MONOTONIC, &t));
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+
+void
+timespec_add(struct timespec* t, long ns)
+{
+    t->tv_nsec += ns;
+    t->tv_sec += t->tv_nsec / 1000000000L;
+    t->tv_nsec %= 1000000000L;
+}
+
+int
+compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+void
+print_latency(const char* what, double* v, size_t n)
+{
+    if (!n) {
+        printf("%s: no samples\n", what);
+        return;
+    }
+    qsort(v, n, sizeof *v, compare_double);
+    printf("%s: p50 %.1lf us, p99 %.1lf us, max %.1lf us (%zu samples)\n",
+           what, 1e6*v[n/2], 1e6*v[n*99/100], 1e6*v[n-1], n);
+}
+
+double
+cpu(int who)
+{
+    struct rusage ru;
+    W(getrusage(who, &ru));
+    return ru.ru_utime.tv_sec + 1e-6*ru.ru_utime.tv_usec +
+           ru.ru_stime.tv_sec + 1e-6*ru.ru_stime.tv_usec;
+}
+
+long
+switches(int who)
+{
+    struct rusage ru;
+    W(getrusage(who, &ru));
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+// Thread bodies for a device session and for a reader that reads until the
+// device goes away.
+
+void*
+e2e_session_run(void* d_void)
+{
+    device_run(d_void);
+    return NULL;
+}
+
+void*
+reader_run(void* d_void)
+{
+    struct device* d = d_void;
+    for (;;) {
+        unsigned char buf[DEVICE_MAX_REPORT_SIZE];
+        size_t size = sizeof buf;
+        if (!device_read(d, 0, buf, &size))
+            return NULL;
+    }
+}
+
+
+static struct {
+    const char* name;
+    int (*run)(int argc, char* argv[]);
+    const char* usage;
+} benches[] = {
+    { "scale", bench_scale, "[-e threads] sessions [rate [seconds]]" },
+    { "idle", bench_idle, "[-c threshold] [-r rate] sessions [seconds]" },
+    { "e2e", bench_e2e, "[-e threads] sessions [rate [seconds]]" },
+    { "replay", bench_replay, "[-s speed] trace" },
+    { "slot", bench_slot, "[seconds]" },
+    { "wakeup", bench_wakeup, "[seconds]" },
+    { "alloc", bench_alloc, "[reports]" },
+    { "ctrl", bench_ctrl, "[latency_ms [trials]]" },
+    { "stall", bench_stall, "[-x | -xx] [gap_ms [trials]]" },
+    { "fixup", bench_fixup, "" },
+    { "log", bench_log, "[-d level] [reports]" },
+    { "connect", bench_connect, "[-s sdp_ms] [trials]" },
+    { "workers", bench_workers, "[-f] readers [seconds]" },
+    { "sessions", bench_sessions, "[-t half_open_ms] addresses [seconds]" },
+    { "mux", bench_mux, "[-p] controllers [rate [seconds]]" },
+    { "hid", bench_hid, "[reports [mutations]]" },
+    { "dispatch", bench_dispatch, "[reports]" },
+    { "output", bench_output, "[-o rate] [writes_per_second [seconds]]" },
+    { "effect", bench_effect, "[-o rate]" },
+    { "timers", bench_timers, "[-c] sessions [seconds]" },
+};
+
+int
+main(int argc, char* argv[])
+{
+    openlog("bench", LOG_PERROR, LOG_USER);
+    sixaxis_init();
+    logger_start();
+    timer_start();
+    signal(SIGPIPE, SIG_IGN); // fake gamepads see disconnects as EPIPE
+    size_t n = sizeof benches / sizeof *benches;
+    for (size_t i = 0; i < n; i++)
+        if (argc >= 2 && !strcmp(argv[1], benches[i].name) &&
+                benches[i].run(argc-2, argv+2))
+            return 0;
+    for (size_t i = 0; i < n; i++)
+        fprintf(stderr, "%s bench %s%s%s\n", i ? "      " : "usage:",
+                benches[i].name, *benches[i].usage ? " " : "",
+                benches[i].usage);
+    return 1;
+}
@@ -0,0 +1,89 @@
+#ifndef BTSIXAD_BENCH_H
+#define BTSIXAD_BENCH_H
+
+#include "device.h"
+
+#include <err.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#define W(f) ({ int r = (f); if (r == -1) err(1, #f); r; })
+
+// A fake controller is the far end of both channels of a device. It answers
+// control requests after a delay, like a Sixaxis over a Bluetooth link, and
+// sends input reports while operational.
+
+struct fake {
+    struct device d;
+    int ctrl, intr;
+    // replies to control requests that are not due yet
+    struct {
+        double due;
+        int operational; // takes effect when due, -1 for no change
+        size_t size;
+        unsigned char msg[DEVICE_MAX_REPORT_SIZE+1];
+    } replies[DEVICE_MAX_QUERIES];
+    int first_reply, nreplies;
+    // The device asked for a report, which device_run does to fill its cache
+    // after setting up LEDs, so it is about to appear and may be opened.
+    atomic_int started;
+    // GET_REPORT replies sent and when the last one was
+    atomic_int get_replies;
+    double get_replied;
+    int operational;
+    double next_report;
+    long reports;
+    unsigned char report[50];
+};
+
+struct fakes {
+    struct fake* f;
+    int n;
+    int ignore_get; // leave GET_REPORT unanswered
+    double latency; // of control replies
+    int rate; // of input reports while operational, 0 for none
+    int flood; // send input reports as fast as possible while operational
+    int spread; // start the reports of each controller at a different phase
+    atomic_int silent; // send no input reports, as if out of range
+};
+
+// Input reports carry the time they were sent in padding.
+#define FAKE_SENT_OFFSET 21
+
+extern const struct transport fake_transport;
+
+struct fake* fake_create(int n);
+void* fake_run(void* fs_void);
+
+double now();
+void timespec_add(struct timespec* t, long ns);
+int compare_double(const void* a, const void* b);
+void print_latency(const char* what, double* v, size_t n);
+double cpu(int who);
+long switches(int who);
+void* e2e_session_run(void* d_void);
+void* reader_run(void* d_void);
+
+int bench_scale(int argc, char* argv[]);
+int bench_idle(int argc, char* argv[]);
+int bench_e2e(int argc, char* argv[]);
+int bench_replay(int argc, char* argv[]);
+int bench_slot(int argc, char* argv[]);
+int bench_wakeup(int argc, char* argv[]);
+int bench_alloc(int argc, char* argv[]);
+int bench_ctrl(int argc, char* argv[]);
+int bench_stall(int argc, char* argv[]);
+int bench_fixup(int argc, char* argv[]);
+int bench_hid(int argc, char* argv[]);
+int bench_dispatch(int argc, char* argv[]);
+int bench_log(int argc, char* argv[]);
+int bench_output(int argc, char* argv[]);
+int bench_effect(int argc, char* argv[]);
+int bench_timers(int argc, char* argv[]);
+int bench_sessions(int argc, char* argv[]);
+int bench_connect(int argc, char* argv[]);
+int bench_workers(int argc, char* argv[]);
+int bench_mux(int argc, char* argv[]);
+
+#endif
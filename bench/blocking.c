@@ -0,0 +1,317 @@
+// Requests that block: reads, control queries and stalls.
+
+#include "bench.h"
+
+#include "host.h"
+#include "report.h"
+#include "wrap.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+
+// bench wakeup [seconds]
+//
+// Block one thread in a read and another in a GET_REPORT that the fake
+// controller never answers, stay idle, then disconnect the controller. Report
+// how often the blocked threads woke up while idle and how long they took to
+// return after the disconnect.
+
+struct blocked {
+    struct device* d;
+    int get;
+    long switches;
+    double returned;
+};
+
+// A blocked thread that wakes up gives up the CPU again, while being
+// preempted while running counts as an involuntary switch.
+static long
+waits(int who)
+{
+    struct rusage ru;
+    W(getrusage(who, &ru));
+    return ru.ru_nvcsw;
+}
+
+static void*
+blocked_run(void* b_void)
+{
+    struct blocked* b = b_void;
+    long before = waits(RUSAGE_THREAD);
+    unsigned char buf[49] = { 0x01 };
+    size_t size = sizeof buf;
+    if (b->get ? device_get_report(b->d, 1, buf, &size) != -1
+               : device_read(b->d, 0, buf, &size))
+        errx(1, "%s returned data", b->get ? "get report" : "read");
+    b->returned = now();
+    b->switches = waits(RUSAGE_THREAD) - before;
+    return NULL;
+}
+
+int
+bench_wakeup(int argc, char* argv[])
+{
+    if (argc > 1)
+        return 0;
+    double seconds = argc ? atof(argv[0]) : 5;
+    if (seconds <= 0)
+        return 0;
+
+    struct fakes fs = { fake_create(1), 1, 1 };
+    struct device* d = &fs.f[0].d;
+    pthread_t ctrl_thread;
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    device_start(d);
+    device_open(d);
+    // The requests of opening would wake up the GET_REPORT, which waits for
+    // its turn, so let them be answered first.
+    for (int busy = 1; busy; usleep(1000)) {
+        wp(pthread_mutex_lock(&d->mutex));
+        busy = d->queries.count;
+        wp(pthread_mutex_unlock(&d->mutex));
+    }
+
+    struct blocked b[2] = { { d, 0 }, { d, 1 } };
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++)
+        if (pthread_create(&threads[i], NULL, blocked_run, &b[i]))
+            errx(1, "pthread_create() failed");
+    usleep(seconds * 1000000);
+
+    // disconnect as the controller would
+    double t0 = now();
+    W(shutdown(fs.f[0].intr, SHUT_RDWR));
+    W(shutdown(fs.f[0].ctrl, SHUT_RDWR));
+    for (int i = 0; i < 2; i++)
+        if (pthread_join(threads[i], NULL))
+            errx(1, "pthread_join() failed");
+    for (int i = 0; i < 2; i++)
+        // one switch to block
+        printf("%s: %.1lf idle wakeups/s, disconnect to EOF %.3lf ms\n",
+               b[i].get ? "get report" : "read",
+               (b[i].switches - 1) / seconds, 1000*(b[i].returned - t0));
+
+    device_stop(d);
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+    return 1;
+}
+
+// bench alloc [reports]
+//
+// Stream reports to a reader with some control queries in between, and fail
+// if the device layer allocated any memory on the way.
+
+int
+bench_alloc(int argc, char* argv[])
+{
+    if (argc > 1)
+        return 0;
+    long n = argc ? atol(argv[0]) : 100000;
+    if (n < 1)
+        return 0;
+
+    struct fakes fs = { fake_create(1), 1 };
+    struct fake* f = &fs.f[0];
+    pthread_t ctrl_thread, reader_thread;
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    device_start(&f->d);
+    device_open(&f->d);
+    if (pthread_create(&reader_thread, NULL, reader_run, &f->d))
+        errx(1, "pthread_create() failed");
+
+    unsigned long before = wm_allocations;
+    unsigned char msg[50] = { 0xa1, 0x01 };
+    for (long i = 0; i < n; i++) {
+        msg[4] = i;
+        W(write(f->intr, msg, sizeof msg));
+        if (i % 100 == 0) {
+            unsigned char buf[49] = { 0x01 };
+            size_t size = sizeof buf;
+            if (device_get_report(&f->d, 1, buf, &size) ||
+                    device_set_report(&f->d, 2, buf, size))
+                errx(1, "control query failed");
+        }
+    }
+    unsigned long allocations = wm_allocations - before;
+
+    device_disconnect(&f->d);
+    if (pthread_join(reader_thread, NULL))
+        errx(1, "pthread_join() failed");
+    device_stop(&f->d);
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+
+    printf("%ld reports, %lu allocations\n", n, allocations);
+    if (allocations)
+        errx(1, "allocated memory per report");
+    return 1;
+}
+
+// bench ctrl [latency_ms [trials]]
+//
+// Open a device, wait for its first input report and close it, with control
+// replies delayed like on a Bluetooth link. Closing sends the same requests
+// as setting up a new connection before its device node is created.
+
+int
+bench_ctrl(int argc, char* argv[])
+{
+    if (argc > 2)
+        return 0;
+    struct fakes fs = { fake_create(1), 1, 0,
+                        (argc > 0 ? atof(argv[0]) : 5) / 1000, 100 };
+    int trials = argc > 1 ? atoi(argv[1]) : 20;
+    if (fs.latency < 0 || trials < 1)
+        return 0;
+
+    struct device* d = &fs.f[0].d;
+    pthread_t fake_thread;
+    if (pthread_create(&fake_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    device_start(d);
+
+    double open = 0, first = 0, hit = 0, miss = 0, close = 0;
+    for (int i = 0; i < trials; i++) {
+        double t0 = now();
+        if (!device_open(d))
+            errx(1, "device_open() failed");
+        double t1 = now();
+        unsigned char buf[49];
+        size_t size = sizeof buf;
+        if (!device_read(d, 0, buf, &size))
+            errx(1, "device_read() failed");
+        double t2 = now();
+        open += t1 - t0;
+        first += t2 - t0;
+        for (int cache = 1; cache >= 0; cache--) {
+            device_set_cache(d, cache);
+            double t = now();
+            unsigned char report[49] = { 0x01 };
+            size = sizeof report;
+            if (device_get_report(d, 1, report, &size))
+                errx(1, "device_get_report() failed");
+            *(cache ? &hit : &miss) += now() - t;
+        }
+        t2 = now();
+        device_close(d);
+        // wait for the requests to be answered before reopening
+        unsigned char id[49] = { 0x01 };
+        size = sizeof id;
+        if (device_get_report(d, 1, id, &size))
+            errx(1, "device_get_report() failed");
+        double t3 = now();
+        close += t3 - t2;
+        usleep(50000); // let reports in flight arrive while closed
+    }
+    printf("control latency %.1lf ms: open %.2lf ms, "
+           "open to first report %.2lf ms, close %.2lf ms\n",
+           1000*fs.latency, 1000*open/trials, 1000*first/trials,
+           1000*close/trials);
+    printf("input GET_REPORT: cached %.1lf us, from device %.1lf us\n",
+           1e6*hit/trials, 1e6*miss/trials);
+
+    device_disconnect(d);
+    device_stop(d);
+    if (pthread_join(fake_thread, NULL))
+        errx(1, "pthread_join() failed");
+    return 1;
+}
+
+// bench stall [-x | -xx] [gap_ms [trials]]
+//
+// Stream input reports from a fake controller to an open device and then go
+// silent, as if out of range, and report how long after the last report was
+// sent the device was flagged as stalled, or reads failed with -x or got end
+// of file with -xx (one trial). Without -x, also report how long after the
+// reports resumed the flag was cleared.
+
+static int
+stalled(struct device* d)
+{
+    struct btsixa_status status;
+    device_status(d, &status);
+    return status.stalled;
+}
+
+int
+bench_stall(int argc, char* argv[])
+{
+    if (argc >= 1 && argv[0][0] == '-') {
+        if (!strcmp(argv[0], "-x"))
+            stall_action = 1;
+        else if (!strcmp(argv[0], "-xx"))
+            stall_action = 2;
+        else
+            return 0;
+        argc--;
+        argv++;
+    }
+    if (argc > 2)
+        return 0;
+    stall_gap = argc > 0 ? atoi(argv[0]) : 200;
+    int trials = stall_action == 2 ? 1 : argc > 1 ? atoi(argv[1]) : 10;
+    if (stall_gap < 1 || trials < 1)
+        return 0;
+    struct fakes fs = { fake_create(1), 1, 0, 0.005, 100 };
+
+    struct device* d = &fs.f[0].d;
+    pthread_t fake_thread;
+    if (pthread_create(&fake_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    device_start(d);
+    if (!device_open(d))
+        errx(1, "device_open() failed");
+
+    double detect[trials], resume[trials];
+    for (int i = 0; i < trials; i++) {
+        usleep(500000); // streaming
+        atomic_store(&fs.silent, 1);
+        unsigned char buf[49];
+        size_t size = sizeof buf;
+        double sent = 0;
+        int r = 0;
+        if (stall_action)
+            while (size = sizeof buf, (r = device_read(d, 0, buf, &size)) > 0)
+                memcpy(&sent, buf+FAKE_SENT_OFFSET, sizeof sent);
+        else {
+            while (!stalled(d))
+                usleep(1000);
+            if (!device_read(d, 1, buf, &size) || !size)
+                errx(1, "device_read() failed");
+            memcpy(&sent, buf+FAKE_SENT_OFFSET, sizeof sent);
+        }
+        detect[i] = now() - sent;
+        if (stall_action == 1 && r != -1 || stall_action == 2 && r)
+            errx(1, "device_read() returned %d", r);
+
+        double t = now();
+        atomic_store(&fs.silent, 0);
+        if (!stall_action)
+            while (stalled(d))
+                usleep(1000);
+        resume[i] = now() - t;
+    }
+    printf("gap %d ms, %s: %d trials\n", stall_gap,
+           stall_action == 2 ? "disconnect" : stall_action ? "fail reads"
+                                                           : "flag only",
+           trials);
+    print_latency("last report to stall", detect, trials);
+    if (!stall_action)
+        print_latency("reports resumed to flag cleared", resume, trials);
+
+    device_disconnect(d);
+    device_stop(d);
+    if (pthread_join(fake_thread, NULL))
+        errx(1, "pthread_join() failed");
+    return 1;
+}
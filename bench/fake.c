@@ -0,0 +1,169 @@
+// Fake controllers for the benchmarks.
+
+#include "bench.h"
+
+#include "report.h"
+#include "sixaxis.h"
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+
+struct fake*
+fake_create(int n)
+{
+    struct fake* fakes = calloc(n, sizeof *fakes);
+    if (!fakes)
+        err(1, "calloc() failed");
+    for (int i = 0; i < n; i++) {
+        struct fake* f = &fakes[i];
+        int sv[2];
+        W(socketpair(PF_LOCAL, SOCK_SEQPACKET, 0, sv));
+        f->d.ctrl = sv[0];
+        f->ctrl = sv[1];
+        W(socketpair(PF_LOCAL, SOCK_SEQPACKET, 0, sv));
+        f->d.intr = sv[0];
+        f->intr = sv[1];
+        f->d.driver = &sixaxis_driver;
+        f->d.model = "fake Sixaxis";
+        f->d.unit = -1;
+        f->report[0] = 0xa1;
+        f->report[1] = 0x01;
+    }
+    return fakes;
+}
+
+static void
+fake_request(struct fakes* fs, struct fake* f, unsigned char* buf, size_t r,
+             double t)
+{
+    if (buf[0] >> 4 == 4)
+        atomic_store(&f->started, 1);
+    if (buf[0] >> 4 == 4 && fs->ignore_get)
+        return;
+    if (f->nreplies == DEVICE_MAX_QUERIES)
+        errx(1, "too many control requests in flight");
+    int i = (f->first_reply + f->nreplies++) % DEVICE_MAX_QUERIES;
+    f->replies[i].due = t + fs->latency;
+    f->replies[i].operational = -1;
+    unsigned char* msg = f->replies[i].msg;
+    if (buf[0] >> 4 == 4) { // GET_REPORT, reply zeros of given size
+        size_t size = r >= 4 ? buf[2] | buf[3] << 8 : 0;
+        if (size > DEVICE_MAX_REPORT_SIZE)
+            size = DEVICE_MAX_REPORT_SIZE;
+        memset(msg+1, 0, size);
+        if (size)
+            msg[1] = buf[1];
+        msg[0] = 0xa0 | buf[0] & 3;
+        f->replies[i].size = 1+size;
+    } else { // HANDSHAKE SUCCESSFUL for everything else
+        if (buf[0] == 0x53 && r >= 4 && buf[1] == 0xf4)
+            f->replies[i].operational = buf[3] == 3;
+        msg[0] = 0;
+        f->replies[i].size = 1;
+    }
+}
+
+// Run all fake controllers until they are disconnected.
+void*
+fake_run(void* fs_void)
+{
+    struct fakes* fs = fs_void;
+    struct pollfd* pfd = calloc(fs->n, sizeof *pfd);
+    if (!pfd)
+        err(1, "calloc() failed");
+    for (int i = 0; i < fs->n; i++) {
+        pfd[i].fd = fs->f[i].ctrl;
+        pfd[i].events = POLLIN;
+    }
+    for (int open = fs->n; open;) {
+        double t = now(), next = 0;
+        int silent = atomic_load(&fs->silent);
+        for (int i = 0; i < fs->n; i++) {
+            struct fake* f = &fs->f[i];
+            if (pfd[i].fd == -1)
+                continue;
+            if (f->nreplies &&
+                    (!next || f->replies[f->first_reply].due < next))
+                next = f->replies[f->first_reply].due;
+            if (f->operational && fs->rate && !silent &&
+                    (!next || f->next_report < next))
+                next = f->next_report;
+            if (f->operational && fs->flood && !silent)
+                next = t;
+            if (f->operational && silent && (!next || t + 0.01 < next))
+                next = t + 0.01; // to notice the end of silence
+        }
+        int ms = !next ? -1 : next <= t ? 0 : (int)((next - t) * 1000) + 1;
+        if (poll(pfd, fs->n, ms) == -1) {
+            if (errno == EINTR)
+                continue;
+            err(1, "poll() failed");
+        }
+        t = now();
+        for (int i = 0; i < fs->n; i++) {
+            struct fake* f = &fs->f[i];
+            if (pfd[i].revents) {
+                unsigned char buf[DEVICE_MAX_REPORT_SIZE+1];
+                ssize_t r = read(pfd[i].fd, buf, sizeof buf);
+                if (r <= 0) {
+                    pfd[i].fd = -1;
+                    open--;
+                    continue;
+                }
+                fake_request(fs, f, buf, r, t);
+            }
+            for (; f->nreplies &&
+                       f->replies[f->first_reply].due <= t; f->nreplies--) {
+                if (write(f->ctrl, f->replies[f->first_reply].msg,
+                          f->replies[f->first_reply].size) == -1 &&
+                        errno != EPIPE) // disconnected
+                    err(1, "write() failed");
+                if (f->replies[f->first_reply].msg[0] >> 4 == 0xa) { // DATA
+                    f->get_replied = t;
+                    atomic_fetch_add(&f->get_replies, 1);
+                }
+                if (f->replies[f->first_reply].operational != -1) {
+                    f->operational = f->replies[f->first_reply].operational;
+                    f->next_report = t;
+                    if (fs->spread && fs->rate)
+                        f->next_report += (double)i / fs->n / fs->rate;
+                }
+                f->first_reply = (f->first_reply + 1) % DEVICE_MAX_QUERIES;
+            }
+            if (f->operational && !silent &&
+                    (fs->flood || fs->rate && f->next_report <= t)) {
+                f->report[4]++; // change some buttons
+                double sent = now();
+                memcpy(f->report+1+FAKE_SENT_OFFSET, &sent, sizeof sent);
+                if (write(f->intr, f->report, sizeof f->report) == -1) {
+                    if (errno != EPIPE)
+                        err(1, "write() failed");
+                    f->operational = 0;
+                } else
+                    f->reports++;
+                f->next_report += 1.0 / fs->rate;
+                if (f->next_report < t)
+                    f->next_report = t + 1.0 / fs->rate;
+            }
+        }
+    }
+    free(pfd);
+    return NULL;
+}
+
+static void
+fake_identify(struct device* d)
+{
+    d->driver = &sixaxis_driver;
+    d->model = "fake Sixaxis";
+}
+
+const struct transport fake_transport =
+    { fake_identify, writev, readv, DEVICE_MAX_QUERIES };
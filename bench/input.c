@@ -0,0 +1,262 @@
+// Transforming input reports, per model and from HID descriptors.
+
+#include "bench.h"
+
+#include "hid.h"
+#include "report.h"
+#include "sixaxis.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dev/usb/usbhid.h>
+
+
+// bench fixup
+//
+// Check that the table-driven sixaxis_fixup matches the shifts and masks of
+// sixaxis_reshuffle over all 2^24 values of the button bytes, then time both.
+
+int
+bench_fixup(int argc, char* argv[])
+{
+    if (argc)
+        return 0;
+    unsigned char a[49] = { 0x01 }, b[49];
+    for (size_t i = 6; i < sizeof a; i++)
+        a[i] = i;
+    for (uint32_t v = 0; v < 1 << 24; v++) {
+        a[2] = v;
+        a[3] = v >> 8;
+        a[4] = v >> 16;
+        memcpy(b, a, sizeof a);
+        sixaxis_reshuffle(a);
+        sixaxis_fixup(NULL, UHID_INPUT_REPORT, b, sizeof b);
+        if (memcmp(a, b, sizeof a))
+            errx(1, "mismatch for 0x%06x", v);
+    }
+
+    for (int table = 0; table < 2; table++) {
+        unsigned sum = 0;
+        double t0 = now();
+        for (uint32_t v = 0; v < 1 << 24; v++) {
+            a[2] = v;
+            a[3] = v >> 8;
+            a[4] = v >> 16;
+            if (table)
+                sixaxis_fixup(NULL, UHID_INPUT_REPORT, a, sizeof a);
+            else
+                sixaxis_reshuffle(a);
+            sum += a[3] + a[4] + a[5];
+        }
+        double t = now() - t0;
+        printf("%s: %.2lf ns/report (checksum %u)\n",
+               table ? "tables" : "shifts", 1e9*t / (1 << 24), sum);
+    }
+    printf("all %d button combinations match\n", 1 << 24);
+    return 1;
+}
+
+// bench hid [reports [mutations]]
+//
+// Compile the descriptor of a typical Bluetooth gamepad and time transforming
+// its input reports, against the Sixaxis fixup for reference. Then compile
+// randomly mutated copies of the descriptor, transforming a random report
+// with each one accepted, and count how many were rejected.
+
+static const unsigned char hid_gamepad[] = {
+    0x05, 0x01, 0x09, 0x05, 0xa1, 0x01, // Gamepad
+    0x85, 0x03,                         //   Report ID - 3
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x10, //   Buttons 1 to 16
+    0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x10, 0x81, 0x02,
+    0x05, 0x01, 0x09, 0x39,             //   Hat switch
+    0x15, 0x00, 0x25, 0x07, 0x75, 0x04, 0x95, 0x01, 0x81, 0x42,
+    0x95, 0x01, 0x81, 0x03,             //   padding
+    0x09, 0x01, 0xa1, 0x00,             //   Pointer
+    0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x35, // X, Y, Z, Rz
+    0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08, 0x95, 0x04, 0x81, 0x02,
+    0xc0,
+    0x05, 0x02, 0x09, 0xc4, 0x09, 0xc5, //   Accelerator, Brake (unused)
+    0x95, 0x02, 0x81, 0x02,
+    0x06, 0x00, 0xff, 0x09, 0x01,       //   vendor-defined
+    0x95, 0x08, 0x81, 0x02,
+    0xc0
+};
+
+int
+bench_hid(int argc, char* argv[])
+{
+    if (argc > 2)
+        return 0;
+    long reports = argc > 0 ? atol(argv[0]) : 10000000;
+    long mutations = argc > 1 ? atol(argv[1]) : 1000000;
+    if (reports < 1 || mutations < 0)
+        return 0;
+
+    const char* error;
+    double t0 = now();
+    for (int i = 0; i < 100000; i++)
+        hid_free(hid_compile(hid_gamepad, sizeof hid_gamepad, &error));
+    double compile = (now() - t0) / 100000;
+    struct hid_plan* p = hid_compile(hid_gamepad, sizeof hid_gamepad, &error);
+    if (!p)
+        errx(1, "descriptor rejected: %s", error);
+    int buttons, hat, axes;
+    hid_summary(p, &buttons, &hat, &axes);
+    printf("compiled in %.2lf us: %d buttons, %s hat switch, %d axes, "
+           "%zu-byte report\n", 1e6*compile, buttons, hat ? "a" : "no",
+           axes, hid_descr(p)->input_size);
+
+    for (int hid = 0; hid < 2; hid++) {
+        unsigned char buf[DEVICE_MAX_REPORT_SIZE] = { 0x01 };
+        unsigned sum = 0;
+        t0 = now();
+        for (long i = 0; i < reports; i++) {
+            if (hid) {
+                buf[0] = 0x03;
+                buf[1] = i;
+                buf[3] = i >> 8;
+                buf[4] = i >> 4;
+                sum += hid_transform(p, buf, 18) + buf[1] + buf[4];
+            } else {
+                buf[2] = i;
+                buf[3] = i >> 8;
+                buf[4] = i >> 4;
+                sixaxis_fixup(NULL, UHID_INPUT_REPORT, buf, 49);
+                sum += buf[3] + buf[4];
+            }
+        }
+        double t = now() - t0;
+        printf("%s: %.2lf ns/report (checksum %u)\n",
+               hid ? "HID plan" : "Sixaxis fixup", 1e9*t / reports, sum);
+    }
+    hid_free(p);
+
+    unsigned noise = 1;
+    long accepted = 0;
+    for (long m = 0; m < mutations; m++) {
+        unsigned char d[sizeof hid_gamepad + 16];
+        size_t size = sizeof hid_gamepad;
+        memcpy(d, hid_gamepad, size);
+        int changes = 1 + m % 8;
+        for (int c = 0; c < changes; c++) {
+            noise = noise * 1103515245 + 12345;
+            unsigned r = noise >> 8;
+            switch (r % 4) {
+            case 0: // truncate
+                size = r / 4 % (size + 1);
+                break;
+            case 1: // insert a byte
+                if (size < sizeof d) {
+                    size_t k = r / 4 % (size + 1);
+                    memmove(d+k+1, d+k, size-k);
+                    d[k] = r >> 16;
+                    size++;
+                }
+                break;
+            default: // change a byte
+                if (size)
+                    d[r / 4 % size] = r >> 16;
+            }
+        }
+        p = hid_compile(d, size, &error);
+        if (!p)
+            continue;
+        accepted++;
+        unsigned char buf[DEVICE_MAX_REPORT_SIZE];
+        for (size_t k = 0; k < sizeof buf; k++) {
+            noise = noise * 1103515245 + 12345;
+            buf[k] = noise >> 16;
+        }
+        size_t n = hid_transform(p, buf, noise % sizeof buf);
+        if (n && n != hid_descr(p)->input_size)
+            errx(1, "transformed report of the wrong size");
+        hid_free(p);
+    }
+    printf("%ld mutated descriptors: %ld accepted, %ld rejected\n",
+           mutations, accepted, mutations - accepted);
+    return 1;
+}
+
+// bench dispatch [reports]
+//
+// Time input reports going through the driver of their device, as in the
+// interrupt channel, against testing the model of the device for each report
+// as was done before there were drivers. Devices take turns, first all
+// Sixaxis, then mixed with a Navigation controller and a HID gamepad. The
+// driver call isn't reliably cheaper: it saves the tests but is an indirect
+// call, and which wins depends on the machine and compiler.
+
+static __attribute__((noinline)) size_t
+branched_input(struct device* d, int sixaxis,
+               unsigned char* buf, size_t size)
+{
+    if (sixaxis)
+        sixaxis_fixup(d, UHID_INPUT_REPORT, buf, size);
+    else if (d->hid && !(size = hid_transform(d->hid, buf, size)))
+        return 0;
+    return size;
+}
+
+static __attribute__((noinline)) size_t
+driver_input(struct device* d, unsigned char* buf, size_t size)
+{
+    return d->driver->input(d, buf, size);
+}
+
+int
+bench_dispatch(int argc, char* argv[])
+{
+    if (argc > 1)
+        return 0;
+    long reports = argc > 0 ? atol(argv[0]) : 100000000;
+    if (reports < 1)
+        return 0;
+
+    const char* error;
+    struct hid_plan* p = hid_compile(hid_gamepad, sizeof hid_gamepad, &error);
+    if (!p)
+        errx(1, "descriptor rejected: %s", error);
+    const struct driver* mixed[4] =
+        { &sixaxis_driver, &navigation_driver, &sixaxis_driver, &hid_driver };
+    struct device ds[4] = {};
+    int sixaxis[4];
+    for (int mix = 0; mix < 2; mix++) {
+        for (int k = 0; k < 4; k++) {
+            ds[k].driver = mix ? mixed[k] : &sixaxis_driver;
+            ds[k].hid = ds[k].driver == &hid_driver ? p : NULL;
+            sixaxis[k] = !ds[k].hid;
+        }
+        for (int table = 0; table < 2; table++) {
+            unsigned char report[49] = { 0x01 };
+            unsigned char hid[DEVICE_MAX_REPORT_SIZE];
+            unsigned sum = 0;
+            double t0 = now();
+            for (long i = 0; i < reports; i++) {
+                struct device* d = &ds[i % 4];
+                unsigned char* buf = report;
+                size_t size = sizeof report;
+                if (d->hid) {
+                    buf = hid;
+                    size = 18;
+                    buf[0] = 0x03;
+                    buf[1] = i;
+                }
+                buf[3] = i >> 8;
+                buf[4] = i >> 4;
+                if (table)
+                    size = driver_input(d, buf, size);
+                else
+                    size = branched_input(d, sixaxis[i % 4], buf, size);
+                sum += size + buf[3] + buf[4];
+            }
+            double t = now() - t0;
+            printf("%s, %s: %.2lf ns/report (checksum %u)\n",
+                   mix ? "mixed" : "Sixaxis",
+                   table ? "driver" : "branches", 1e9*t / reports, sum);
+        }
+    }
+    hid_free(p);
+    return 1;
+}
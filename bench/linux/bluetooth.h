@@ -0,0 +1,37 @@
+#ifndef BENCH_LINUX_BLUETOOTH_H
+#define BENCH_LINUX_BLUETOOTH_H
+
+// The parts of the FreeBSD Bluetooth library that the device layer uses for
+// addresses, which the bench needs without an adapter.
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+    uint8_t b[6];
+} bdaddr_t;
+
+#define NG_HCI_BDADDR_ANY (&(const bdaddr_t){ { 0 } })
+
+static inline int
+bdaddr_same(const bdaddr_t* a, const bdaddr_t* b)
+{
+    return !memcmp(a, b, sizeof *a);
+}
+
+static inline int
+bdaddr_any(const bdaddr_t* a)
+{
+    return bdaddr_same(a, NG_HCI_BDADDR_ANY);
+}
+
+static inline void
+bdaddr_copy(bdaddr_t* dst, const bdaddr_t* src)
+{
+    *dst = *src;
+}
+
+const char* bt_ntoa(const bdaddr_t* ba, char* str);
+int bt_aton(const char* str, bdaddr_t* ba);
+
+#endif
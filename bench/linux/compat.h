@@ -0,0 +1,10 @@
+// Included before everything when building the bench on Linux, for the BSD
+// functions that glibc lacks.
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+
+void errc(int eval, int code, const char* fmt, ...)
+    __attribute__((noreturn, format(printf, 3, 4)));
+size_t strlcat(char* dst, const char* src, size_t size);
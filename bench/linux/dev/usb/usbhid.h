@@ -0,0 +1,9 @@
+#ifndef BENCH_LINUX_USBHID_H
+#define BENCH_LINUX_USBHID_H
+
+// Report kinds as numbered by uhid(4).
+#define UHID_INPUT_REPORT 0x01
+#define UHID_OUTPUT_REPORT 0x02
+#define UHID_FEATURE_REPORT 0x03
+
+#endif
@@ -0,0 +1,132 @@
+// Stand-ins for what the bench doesn't build on Linux: the event loop, which
+// needs kqueue, the cuse devices and the Bluetooth and SDP libraries. Devices
+// run on their own threads and are never attached, as with btsixad -d when
+// cuse isn't loaded.
+
+#include "loop.h"
+#include "vuhid.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sdp.h>
+
+
+void
+loop_start(int threads)
+{
+    if (threads)
+        errx(1, "the event loop needs kqueue");
+}
+
+int
+loop_add(struct device* d)
+{
+    return 0;
+}
+
+
+void
+vuhid_allocate_unit(struct device* d)
+{
+    d->unit = -1;
+}
+
+void
+vuhid_open(struct device* d)
+{
+}
+
+void
+vuhid_close(struct device* d)
+{
+}
+
+void
+vuhid_wakeup()
+{
+}
+
+int
+vuhid_cancelled()
+{
+    return 0;
+}
+
+
+const char*
+bt_ntoa(const bdaddr_t* ba, char* str)
+{
+    static char buf[18];
+    if (!str)
+        str = buf;
+    snprintf(str, 18, "%02x:%02x:%02x:%02x:%02x:%02x",
+             ba->b[5], ba->b[4], ba->b[3], ba->b[2], ba->b[1], ba->b[0]);
+    return str;
+}
+
+int
+bt_aton(const char* str, bdaddr_t* ba)
+{
+    unsigned b[6];
+    char end;
+    if (sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x%c",
+               &b[5], &b[4], &b[3], &b[2], &b[1], &b[0], &end) != 6)
+        return 0;
+    for (int i = 0; i < 6; i++)
+        ba->b[i] = b[i];
+    return 1;
+}
+
+
+// A session that fails at once, with an error to say why.
+static int no_sdp;
+
+void*
+sdp_open(const bdaddr_t* l, const bdaddr_t* r)
+{
+    return &no_sdp;
+}
+
+int
+sdp_search(void* xs, uint32_t plen, const uint16_t* pp, uint32_t alen,
+           const uint32_t* ap, uint32_t vlen, sdp_attr_t* vp)
+{
+    return -1;
+}
+
+int
+sdp_error(void* xs)
+{
+    return EOPNOTSUPP;
+}
+
+int
+sdp_close(void* xs)
+{
+    return 0;
+}
+
+
+void
+errc(int eval, int code, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    errno = code;
+    verr(eval, fmt, ap);
+}
+
+size_t
+strlcat(char* dst, const char* src, size_t size)
+{
+    size_t n = strnlen(dst, size), m = strlen(src);
+    if (n < size) {
+        size_t k = m < size-n-1 ? m : size-n-1;
+        memcpy(dst+n, src, k);
+        dst[n+k] = '\0';
+    }
+    return n + m;
+}
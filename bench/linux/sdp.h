@@ -0,0 +1,28 @@
+#ifndef BENCH_LINUX_SDP_H
+#define BENCH_LINUX_SDP_H
+
+// SDP as declared by the FreeBSD library. Queries fail, so the bench gives
+// its fake gamepads a transport that doesn't make them.
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t flags;
+    uint16_t attr;
+    uint32_t vlen;
+    uint8_t* value;
+} sdp_attr_t;
+
+#define SDP_ATTR_OK 0
+#define SDP_ATTR_INVALID 1
+#define SDP_ATTR_RANGE(lo, hi) ((uint32_t)(lo) << 16 | (uint16_t)(hi))
+#define SDP_SERVICE_CLASS_HUMAN_INTERFACE_DEVICE 0x1124
+#define SDP_SERVICE_CLASS_PNP_INFORMATION 0x1200
+
+void* sdp_open(const bdaddr_t* l, const bdaddr_t* r);
+int sdp_search(void* xs, uint32_t plen, const uint16_t* pp, uint32_t alen,
+               const uint32_t* ap, uint32_t vlen, sdp_attr_t* vp);
+int sdp_error(void* xs);
+int sdp_close(void* xs);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef BENCH_LINUX_IOCCOM_H
+#define BENCH_LINUX_IOCCOM_H
+
+#include <sys/ioctl.h>
+
+#endif
@@ -0,0 +1,94 @@
+// The cost of logging on the report path.
+
+#include "bench.h"
+
+#include "host.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+// bench log [-d level] [reports]
+//
+// Flood an open device with input reports while timing a SET_REPORT every
+// 100 reports, with debugging output at the given level as with btsixad -d
+// going to /dev/null, and report the time per input report and the latency
+// of the control requests.
+
+int
+bench_log(int argc, char* argv[])
+{
+    if (argc >= 2 && !strcmp(argv[0], "-d")) {
+        dflag = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 1)
+        return 0;
+    long n = argc ? atol(argv[0]) : 200000;
+    if (n < 100 || dflag < 0)
+        return 0;
+
+    fflush(stdout);
+    FILE* results = fdopen(W(dup(1)), "w");
+    if (!results)
+        err(1, "fdopen() failed");
+    int null = W(open("/dev/null", O_WRONLY));
+    W(dup2(null, 1));
+    W(close(null));
+
+    struct fakes fs = { fake_create(1), 1 };
+    struct fake* f = &fs.f[0];
+    pthread_t ctrl_thread, reader_thread;
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    device_start(&f->d);
+    device_open(&f->d);
+    if (pthread_create(&reader_thread, NULL, reader_run, &f->d))
+        errx(1, "pthread_create() failed");
+
+    size_t queries = n / 100;
+    double* latency = malloc(queries * sizeof *latency);
+    if (!latency)
+        err(1, "malloc() failed");
+    unsigned char msg[50] = { 0xa1, 0x01 };
+    double t0 = now();
+    for (long i = 0; i < n; i++) {
+        msg[4] = i;
+        W(write(f->intr, msg, sizeof msg));
+        if (i % 100 == 0) {
+            unsigned char buf[49] = { 0x01 };
+            double t = now();
+            if (device_set_report(&f->d, 2, buf, sizeof buf))
+                errx(1, "control query failed");
+            latency[i / 100] = now() - t;
+        }
+    }
+    struct btsixa_stats stats;
+    do {
+        usleep(100);
+        device_stats(&f->d, &stats);
+    } while (stats.reports < n);
+    double t = now() - t0;
+
+    device_disconnect(&f->d);
+    if (pthread_join(reader_thread, NULL))
+        errx(1, "pthread_join() failed");
+    device_stop(&f->d);
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+
+    qsort(latency, queries, sizeof *latency, compare_double);
+    fprintf(results, "debug level %d, %ld reports: %.0lf ns per report, "
+            "SET_REPORT p50 %.1lf us, p99 %.1lf us\n",
+            dflag, n, 1e9*t / n, 1e6*latency[queries/2],
+            1e6*latency[queries*99/100]);
+    fclose(results);
+    free(latency);
+    return 1;
+}
@@ -0,0 +1,202 @@
+// Output reports written by programs and played as effects.
+
+#include "bench.h"
+
+#include "host.h"
+#include "report.h"
+#include "session.h"
+#include "wrap.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+// bench output [-o rate] [writes_per_second [seconds]]
+//
+// Write rumble to an open device at the given rate, as games do every frame,
+// with the strength changing every third write, and count the output reports
+// that reach a fake gamepad with btsixad -o rate. Check that the last state
+// written is the last one sent.
+
+// A session whose fake gamepad keeps the output reports it gets.
+struct output_bench {
+    struct fakes fs;
+    pthread_t ctrl_thread, session_thread, drain_thread;
+    long messages;
+    unsigned char last[50];
+    double at[256]; // when the first messages came
+    unsigned char strong[256]; // and their large motor force
+};
+
+static void*
+output_drain_run(void* o_void)
+{
+    struct output_bench* o = o_void;
+    unsigned char buf[DEVICE_MAX_REPORT_SIZE+1];
+    ssize_t r;
+    while ((r = read(o->fs.f[0].intr, buf, sizeof buf)) > 0)
+        if (buf[0] == 0xa2) {
+            if (o->messages < sizeof o->at / sizeof *o->at) {
+                o->at[o->messages] = now();
+                o->strong[o->messages] = r > 6 ? buf[6] : 0;
+            }
+            o->messages++;
+            memcpy(o->last, buf, r < sizeof o->last ? r : sizeof o->last);
+        }
+    return NULL;
+}
+
+static struct device*
+output_start(struct output_bench* o)
+{
+    memset(o, 0, sizeof *o);
+    o->fs = (struct fakes){ fake_create(1), 1, 0, 0.001 };
+    struct fake* f = &o->fs.f[0];
+    f->d.transport = &fake_transport;
+    f->d.driver = NULL; // up to identify
+    wp(pthread_mutex_init(&f->d.mutex, NULL)); // like the server
+    if (pthread_create(&o->ctrl_thread, NULL, fake_run, &o->fs) ||
+            pthread_create(&o->session_thread, NULL, e2e_session_run,
+                           &f->d) ||
+            pthread_create(&o->drain_thread, NULL, output_drain_run, o))
+        errx(1, "pthread_create() failed");
+    while (!atomic_load(&f->started))
+        usleep(1000);
+    if (!device_open(&f->d))
+        errx(1, "device_open() failed");
+    return &f->d;
+}
+
+static void
+output_stop(struct output_bench* o, struct btsixa_stats* stats)
+{
+    struct device* d = &o->fs.f[0].d;
+    device_stats(d, stats);
+    device_disconnect(d);
+    if (pthread_join(o->session_thread, NULL) ||
+            pthread_join(o->drain_thread, NULL) ||
+            pthread_join(o->ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+    W(close(d->intr));
+    W(close(d->ctrl));
+    free(o->fs.f);
+    if (o->messages != stats->output_sent)
+        errx(1, "%ju output reports counted", (uintmax_t)stats->output_sent);
+}
+
+int
+bench_output(int argc, char* argv[])
+{
+    if (argc >= 2 && !strcmp(argv[0], "-o")) {
+        output_rate = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 2)
+        return 0;
+    int rate = argc > 0 ? atoi(argv[0]) : 60;
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    if (output_rate < 0 || rate < 1 || seconds <= 0)
+        return 0;
+
+    struct output_bench o;
+    struct device* d = output_start(&o);
+    unsigned char rumble[49] = { 0x01, 0x00, 0x10, 0x01, 0x10 };
+    long writes = 0;
+    double t0 = now();
+    for (double next = t0; next < t0 + seconds; next += 1.0 / rate) {
+        double t = now();
+        if (next > t)
+            usleep((next - t) * 1e6);
+        rumble[5] = writes++ / 3;
+        if (!device_write(d, rumble, sizeof rumble))
+            errx(1, "device_write() failed");
+    }
+    struct btsixa_stats stats;
+    do {
+        usleep(1000);
+        device_stats(d, &stats);
+    } while (stats.output_sent + stats.output_coalesced < writes);
+    usleep(10000);
+    output_stop(&o, &stats);
+
+    printf("%ld writes at %d/s, limit %d/s: %ld output reports sent "
+           "(%.1lf/s), %ju writes coalesced\n", writes, rate, output_rate,
+           o.messages, o.messages / seconds,
+           (uintmax_t)stats.output_coalesced);
+    if (memcmp(o.last+1, rumble, sizeof rumble))
+        errx(1, "last state written was not sent");
+    return 1;
+}
+
+// bench effect [-o rate]
+//
+// Rumble an open device with a 300 ms pulse fading out in 16 steps of 25 ms,
+// first as a single effect and then as a program would without one, writing
+// each step on time. Report the calls made, the output reports that reach a
+// fake gamepad with btsixad -o rate and how late each is for its step.
+
+int
+bench_effect(int argc, char* argv[])
+{
+    if (argc >= 2 && !strcmp(argv[0], "-o")) {
+        output_rate = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc || output_rate < 0)
+        return 0;
+
+    struct btsixa_effect e = { 17, { { 0, 255, 300 } } };
+    for (int k = 1; k < 17; k++)
+        e.steps[k] = (struct btsixa_effect_step){ 0, 255 - 15*k, 25 };
+    double start[256] = {}; // of the step with each force, 0 to stop
+    int total = 0;
+    for (int k = 0; k < 17; k++) {
+        start[e.steps[k].strong] = 1e-3 * total;
+        total += e.steps[k].ms;
+    }
+    start[0] = 1e-3 * total;
+
+    for (int played = 1; played >= 0; played--) {
+        struct output_bench o;
+        struct device* d = output_start(&o);
+        long calls = 0;
+        double t0 = now();
+        if (played) {
+            if (!device_play_effect(d, &e))
+                errx(1, "device_play_effect() failed");
+            calls++;
+        } else {
+            unsigned char rumble[49] = { 0x01 };
+            for (int k = 0; k <= 17; k++) {
+                double t = t0 + (k < 17 ? start[e.steps[k].strong] : start[0]);
+                if (t > now())
+                    usleep((t - now()) * 1e6);
+                rumble[4] = k < 17 ? 0xff : 0;
+                rumble[5] = k < 17 ? e.steps[k].strong : 0;
+                if (!device_write(d, rumble, sizeof rumble))
+                    errx(1, "device_write() failed");
+                calls++;
+            }
+        }
+        double t = t0 + start[0] + 0.1; // for the stop to arrive
+        if (t > now())
+            usleep((t - now()) * 1e6);
+        struct btsixa_stats stats;
+        output_stop(&o, &stats);
+
+        double late[256];
+        size_t n = o.messages;
+        for (size_t i = 0; i < n; i++)
+            late[i] = o.at[i] - t0 - start[o.strong[i]];
+        printf("%s, limit %d/s: %ld calls, %ld output reports sent\n",
+               played ? "effect" : "writes", output_rate, calls, o.messages);
+        print_latency("lateness", late, n);
+    }
+    return 1;
+}
@@ -0,0 +1,182 @@
+// Replaying a trace written with btsixad -w.
+
+#include "bench.h"
+
+#include "capture.h"
+#include "report.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+// bench replay [-s speed] trace
+//
+// Feed the input reports of a trace written by btsixad -w to open devices,
+// one per gamepad in the trace, at the original pace times speed, or as fast
+// as the readers keep up with speed 0. Readers use a queue of
+// REPORT_MAX_DEPTH and hash everything they read, so without overruns the
+// hash only changes if the reports delivered do.
+
+struct replay_reader {
+    struct device* d;
+    long reads;
+    uint64_t hash;
+};
+
+static void*
+replay_reader_run(void* r_void)
+{
+    struct replay_reader* r = r_void;
+    unsigned char buf[REPORT_MAX_DEPTH * 49];
+    size_t size;
+    r->hash = 14695981039346656037ULL; // FNV-1a
+    while (size = sizeof buf, device_read(r->d, 0, buf, &size)) {
+        for (size_t i = 0; i < size; i++)
+            r->hash = (r->hash ^ buf[i]) * 1099511628211ULL;
+        r->reads++;
+    }
+    return NULL;
+}
+
+int
+bench_replay(int argc, char* argv[])
+{
+    double speed = 1;
+    if (argc >= 2 && !strcmp(argv[0], "-s")) {
+        speed = atof(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 1 || speed < 0)
+        return 0;
+
+    int fd = W(open(argv[0], O_RDONLY));
+    struct stat st;
+    W(fstat(fd, &st));
+    unsigned char* trace = malloc(st.st_size);
+    if (!trace)
+        err(1, "malloc() failed");
+    if (read(fd, trace, st.st_size) != st.st_size)
+        errx(1, "%s: short read", argv[0]);
+    W(close(fd));
+    size_t magic = sizeof CAPTURE_MAGIC - 1;
+    if (st.st_size < magic || memcmp(trace, CAPTURE_MAGIC, magic))
+        errx(1, "%s: not a trace", argv[0]);
+
+    // First pass: count input reports per gamepad.
+    struct fakes fs = { NULL, 0 };
+    bdaddr_t addrs[64];
+    long sent[64] = { 0 };
+    long records = 0;
+    for (size_t at = magic; at < st.st_size;) {
+        struct capture_record r;
+        if (st.st_size - at < sizeof r)
+            errx(1, "%s: truncated", argv[0]);
+        memcpy(&r, trace+at, sizeof r);
+        if (st.st_size - at - sizeof r < r.size)
+            errx(1, "%s: truncated", argv[0]);
+        at += sizeof r + r.size;
+        records++;
+        if (r.flags || r.message != 0xa1) // not a received input report
+            continue;
+        int i;
+        for (i = 0; i < fs.n; i++)
+            if (!memcmp(&addrs[i], r.bdaddr, sizeof r.bdaddr))
+                break;
+        if (i == fs.n) {
+            if (fs.n == sizeof addrs / sizeof *addrs)
+                errx(1, "too many gamepads in trace");
+            memcpy(&addrs[fs.n++], r.bdaddr, sizeof r.bdaddr);
+        }
+        sent[i]++;
+    }
+    if (!fs.n)
+        errx(1, "%s: no input reports", argv[0]);
+
+    fs.f = fake_create(fs.n);
+    struct replay_reader readers[64];
+    pthread_t ctrl_thread, reader_threads[64];
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    for (int i = 0; i < fs.n; i++) {
+        struct device* d = &fs.f[i].d;
+        bdaddr_copy(&d->bdaddr, &addrs[i]);
+        device_start(d);
+        device_open(d);
+        device_set_queue(d, REPORT_MAX_DEPTH);
+        readers[i] = (struct replay_reader){ d };
+        if (pthread_create(&reader_threads[i], NULL, replay_reader_run,
+                           &readers[i]))
+            errx(1, "pthread_create() failed");
+    }
+
+    double t0 = now();
+    uint64_t first = 0, written[64] = { 0 };
+    for (size_t at = magic; at < st.st_size;) {
+        struct capture_record r;
+        memcpy(&r, trace+at, sizeof r);
+        unsigned char* data = trace + at + sizeof r;
+        at += sizeof r + r.size;
+        if (r.flags || r.message != 0xa1)
+            continue;
+        if (!first)
+            first = r.time;
+        if (speed) {
+            double due = t0 + 1e-9*(r.time - first) / speed;
+            for (double t; (t = now()) < due;)
+                usleep((due - t) * 1e6);
+        }
+        int i = 0;
+        while (memcmp(&addrs[i], r.bdaddr, sizeof r.bdaddr))
+            i++;
+        if (!speed)
+            while (written[i] - atomic_load(&fs.f[i].d.input.tail) >=
+                       REPORT_MAX_DEPTH / 2)
+                usleep(100);
+        struct iovec iov[2] = { { &r.message, 1 }, { data, r.size } };
+        W(writev(fs.f[i].intr, iov, 2));
+        written[i]++;
+    }
+
+    // Wait for every report to be processed and read.
+    long reads = 0, replayed = 0;
+    uint64_t overruns = 0, hash = 0;
+    for (int i = 0; i < fs.n; i++) {
+        struct device* d = &fs.f[i].d;
+        struct btsixa_stats stats;
+        do {
+            usleep(1000);
+            device_stats(d, &stats);
+        } while (stats.reports < sent[i] || report_ready(&d->input));
+    }
+    double t = now() - t0;
+    for (int i = 0; i < fs.n; i++) {
+        struct device* d = &fs.f[i].d;
+        struct btsixa_stats stats;
+        device_stats(d, &stats);
+        overruns += stats.overruns;
+        device_disconnect(d);
+        if (pthread_join(reader_threads[i], NULL))
+            errx(1, "pthread_join() failed");
+        device_stop(d);
+        reads += readers[i].reads;
+        replayed += sent[i];
+        hash = hash * 31 + readers[i].hash;
+    }
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+    free(trace);
+
+    printf("%ld records, %d gamepads: replayed %ld input reports in %.3lf s "
+           "(%.0lf/s), %ld reads, %ju overruns, hash %016jx\n",
+           records, fs.n, replayed, t, replayed / t, reads,
+           (uintmax_t)overruns, (uintmax_t)hash);
+    return 1;
+}
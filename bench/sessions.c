@@ -0,0 +1,242 @@
+// Accepting connections and identifying gamepads.
+
+#include "bench.h"
+
+#include "pnp.h"
+#include "session.h"
+#include "sixaxis.h"
+#include "wrap.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+
+// bench sessions [-t half_open_ms] addresses [seconds]
+//
+// Hammer the session table from two threads, standing in for the control
+// and interrupt listeners, that accept channels from random addresses out of
+// the given number as fast as they can. Sessions end as soon as they start,
+// as for a device that isn't a gamepad, and channels left half-open are
+// reaped. Report the time per accept and check that every session and file
+// descriptor is gone once the last half-open ones are reaped.
+
+static void
+gone_identify(struct device* d)
+{
+    d->driver = NULL;
+    d->model = "not a gamepad";
+}
+
+static const struct transport gone_transport =
+    { gone_identify, writev, readv, DEVICE_MAX_QUERIES };
+
+struct hammer {
+    int ctrl, addresses;
+    double seconds;
+    unsigned seed;
+    double* latency;
+    size_t samples, max_samples;
+    long accepts;
+};
+
+static void*
+hammer_run(void* h_void)
+{
+    struct hammer* h = h_void;
+    double end = now() + h->seconds;
+    for (double t = 0; t < end;) {
+        h->seed = h->seed * 1103515245 + 12345;
+        unsigned i = (h->seed >> 8) % h->addresses;
+        bdaddr_t a = { { i, i >> 8, i >> 16, 0xbe, 0xbe, 0xbe } };
+        int sv[2];
+        W(socketpair(PF_LOCAL, SOCK_SEQPACKET, 0, sv));
+        W(close(sv[1]));
+        double t0 = now();
+        session_accept(&a, h->ctrl, sv[0]);
+        t = now();
+        if (h->samples < h->max_samples)
+            h->latency[h->samples++] = t - t0;
+        h->accepts++;
+    }
+    return NULL;
+}
+
+static int
+open_fds()
+{
+    int n = 0;
+    for (int fd = 0; fd < getdtablesize(); fd++)
+        if (fcntl(fd, F_GETFD) != -1)
+            n++;
+    return n;
+}
+
+int
+bench_sessions(int argc, char* argv[])
+{
+    int half_open_ms = 1000;
+    if (argc >= 2 && !strcmp(argv[0], "-t")) {
+        half_open_ms = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 1 || argc > 2)
+        return 0;
+    int addresses = atoi(argv[0]);
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    if (half_open_ms < 0 || addresses < 1 || addresses > 1 << 24 ||
+            seconds <= 0)
+        return 0;
+
+    setlogmask(LOG_UPTO(LOG_NOTICE)); // not every connection
+    session_start(&gone_transport, half_open_ms);
+    int fds = open_fds();
+    struct hammer h[2];
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        h[i] = (struct hammer){ i, addresses, seconds, i+1 };
+        h[i].max_samples = 1 << 20;
+        h[i].latency = malloc(h[i].max_samples * sizeof *h[i].latency);
+        if (!h[i].latency)
+            err(1, "malloc() failed");
+        if (pthread_create(&threads[i], NULL, hammer_run, &h[i]))
+            errx(1, "pthread_create() failed");
+    }
+    for (int i = 0; i < 2; i++)
+        if (pthread_join(threads[i], NULL))
+            errx(1, "pthread_join() failed");
+
+    struct session_stats stats;
+    double end = now() + half_open_ms / 1000.0 + 5;
+    do {
+        usleep(10000);
+        session_stats(&stats);
+    } while (stats.open && now() < end);
+    int leaked = open_fds() - fds;
+
+    size_t samples = h[0].samples + h[1].samples;
+    double* latency = malloc(samples * sizeof *latency);
+    if (!latency)
+        err(1, "malloc() failed");
+    memcpy(latency, h[0].latency, h[0].samples * sizeof *latency);
+    memcpy(latency + h[0].samples, h[1].latency,
+           h[1].samples * sizeof *latency);
+    printf("%d addresses: %.0lf accepts/s, %ju sessions started, "
+           "%ju duplicate channels, %ju half-open reaped\n",
+           addresses, (h[0].accepts + h[1].accepts) / seconds,
+           (uintmax_t)stats.started, (uintmax_t)stats.duplicates,
+           (uintmax_t)stats.reaped);
+    print_latency("accept", latency, samples);
+    free(latency);
+    free(h[0].latency);
+    free(h[1].latency);
+    if (stats.open)
+        errx(1, "%ju sessions left", (uintmax_t)stats.open);
+    if (leaked)
+        errx(1, "%d file descriptors leaked", leaked);
+    return 1;
+}
+
+// bench connect [-s sdp_ms] [trials]
+//
+// Run sessions of a fake gamepad from identifying it to its device being
+// created, i.e. until the last feature report read on connection arrives,
+// with SDP queries taking the given time and control replies 5 ms. The first
+// session finds the SDP cache empty and the rest find it filled.
+
+static int sdp_ms = 100;
+
+static int
+fake_sdp(const bdaddr_t* bdaddr, struct pnp_info* info)
+{
+    usleep(sdp_ms * 1000);
+    *info = (struct pnp_info){ 0x054c, 0x0268, 0x0100, 2 };
+    return 1;
+}
+
+static void
+sdp_identify(struct device* d)
+{
+    struct pnp_info info;
+    if (!pnp_lookup(&d->bdaddr, &info, fake_sdp))
+        errx(1, "SDP query failed");
+    device_identify(d, &info);
+}
+
+static const struct transport sdp_transport =
+    { sdp_identify, writev, readv, DEVICE_MAX_QUERIES };
+
+int
+bench_connect(int argc, char* argv[])
+{
+    if (argc >= 2 && !strcmp(argv[0], "-s")) {
+        sdp_ms = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 1)
+        return 0;
+    int trials = argc ? atoi(argv[0]) : 20;
+    if (sdp_ms < 0 || trials < 2)
+        return 0;
+
+    setlogmask(LOG_UPTO(LOG_INFO)); // not every connection
+    char path[] = "/tmp/bench.sdp.XXXXXX";
+    W(close(W(mkstemp(path))));
+    W(unlink(path));
+    pnp_init(path);
+    pnp_start();
+
+    double* warm = malloc(trials * sizeof *warm);
+    if (!warm)
+        err(1, "malloc() failed");
+    double cold;
+    for (int i = 0; i < trials; i++) {
+        struct fakes fs = { fake_create(1), 1, 0, 0.005 };
+        struct fake* f = &fs.f[0];
+        f->d.transport = &sdp_transport;
+        f->d.driver = NULL; // up to identify
+        wp(pthread_mutex_init(&f->d.mutex, NULL)); // like the server
+        pthread_t ctrl_thread, session_thread;
+        if (pthread_create(&ctrl_thread, NULL, fake_run, &fs))
+            errx(1, "pthread_create() failed");
+        double t0 = now();
+        if (pthread_create(&session_thread, NULL, e2e_session_run, &f->d))
+            errx(1, "pthread_create() failed");
+        while (atomic_load(&f->get_replies) < sixaxis_descr.n_static_features)
+            usleep(100);
+        double t = f->get_replied - t0;
+        if (i)
+            warm[i-1] = t;
+        else
+            cold = t;
+
+        device_disconnect(&f->d);
+        if (pthread_join(session_thread, NULL) ||
+                pthread_join(ctrl_thread, NULL))
+            errx(1, "pthread_join() failed");
+        W(close(f->d.intr));
+        W(close(f->d.ctrl));
+        W(close(f->intr));
+        W(close(f->ctrl));
+        free(fs.f);
+    }
+
+    printf("SDP query %d ms, control latency 5 ms\n", sdp_ms);
+    printf("connection to device, cold cache: %.1lf ms\n", 1e3*cold);
+    qsort(warm, trials-1, sizeof *warm, compare_double);
+    printf("connection to device, warm cache: p50 %.1lf ms, max %.1lf ms "
+           "(%d trials)\n", 1e3*warm[(trials-1)/2], 1e3*warm[trials-2],
+           trials-1);
+    free(warm);
+    unlink(path);
+    return 1;
+}
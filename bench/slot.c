@@ -0,0 +1,169 @@
+// Contention on the latest-report slot.
+
+#include "bench.h"
+
+#include "report.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// bench slot [seconds]
+//
+// Publish reports at 1 kHz to a blocking reader while another thread keeps
+// holding the device mutex for 200 us at a time, as a debug print blocked on
+// output would. Report put and put-to-read latency, first for the old
+// scheme that copies under the device mutex, then for the report slot.
+
+#define SLOT_SIZE 49
+
+struct slot_bench {
+    int lockfree;
+    double seconds;
+    pthread_mutex_t mutex; // stands for d->mutex
+    pthread_cond_t cond;
+    int stop;
+    // old scheme, protected by mutex
+    unsigned char data[SLOT_SIZE];
+    size_t size;
+    // new scheme
+    struct report_buf b;
+    // results
+    double *put, *read;
+    size_t nput, nread;
+};
+
+static int
+never()
+{
+    return 0;
+}
+
+static void*
+slot_contend_run(void* sb_void)
+{
+    struct slot_bench* sb = sb_void;
+    for (;;) {
+        if (pthread_mutex_lock(&sb->mutex))
+            errx(1, "pthread_mutex_lock() failed");
+        int stop = sb->stop;
+        usleep(200);
+        if (pthread_mutex_unlock(&sb->mutex))
+            errx(1, "pthread_mutex_unlock() failed");
+        if (stop)
+            return NULL;
+        usleep(800);
+    }
+}
+
+static void*
+slot_read_run(void* sb_void)
+{
+    struct slot_bench* sb = sb_void;
+    for (;;) {
+        unsigned char buf[SLOT_SIZE];
+        size_t size = sizeof buf;
+        if (sb->lockfree) {
+            while (!report_get(&sb->b, buf, &size, NULL)) {
+                if (report_closed(&sb->b))
+                    return NULL;
+                report_wait(&sb->b, never);
+            }
+        } else {
+            if (pthread_mutex_lock(&sb->mutex))
+                errx(1, "pthread_mutex_lock() failed");
+            while (!sb->size && !sb->stop)
+                if (pthread_cond_wait(&sb->cond, &sb->mutex))
+                    errx(1, "pthread_cond_wait() failed");
+            if (!sb->size) {
+                pthread_mutex_unlock(&sb->mutex);
+                return NULL;
+            }
+            memcpy(buf, sb->data, size = sb->size);
+            sb->size = 0;
+            if (pthread_mutex_unlock(&sb->mutex))
+                errx(1, "pthread_mutex_unlock() failed");
+        }
+        double t;
+        memcpy(&t, buf+1, sizeof t);
+        sb->read[sb->nread++] = now() - t;
+    }
+}
+
+static void
+slot_run(struct slot_bench* sb)
+{
+    size_t n = sb->seconds * 1000;
+    sb->put = calloc(n, sizeof *sb->put);
+    sb->read = calloc(n, sizeof *sb->read);
+    if (!sb->put || !sb->read)
+        err(1, "calloc() failed");
+    sb->nput = sb->nread = 0;
+    sb->stop = 0;
+    sb->size = 0;
+    report_init(&sb->b, SLOT_SIZE);
+
+    pthread_t contend, reader;
+    if (pthread_create(&contend, NULL, slot_contend_run, sb) ||
+            pthread_create(&reader, NULL, slot_read_run, sb))
+        errx(1, "pthread_create() failed");
+
+    unsigned char buf[SLOT_SIZE] = { 0x01 };
+    struct timespec t;
+    W(clock_gettime(CLOCK_MONOTONIC, &t));
+    for (size_t i = 0; i < n; i++) {
+        timespec_add(&t, 1000000);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL))
+            ;
+        double t0 = now();
+        memcpy(buf+1, &t0, sizeof t0);
+        if (sb->lockfree)
+            report_put(&sb->b, buf, sizeof buf, NULL);
+        else {
+            if (pthread_mutex_lock(&sb->mutex))
+                errx(1, "pthread_mutex_lock() failed");
+            memcpy(sb->data, buf, sb->size = sizeof buf);
+            if (pthread_cond_signal(&sb->cond) ||
+                    pthread_mutex_unlock(&sb->mutex))
+                errx(1, "pthread failed");
+        }
+        sb->put[sb->nput++] = now() - t0;
+    }
+
+    if (pthread_mutex_lock(&sb->mutex))
+        errx(1, "pthread_mutex_lock() failed");
+    sb->stop = 1;
+    if (pthread_cond_broadcast(&sb->cond) || pthread_mutex_unlock(&sb->mutex))
+        errx(1, "pthread failed");
+    report_close(&sb->b);
+    if (pthread_join(contend, NULL) || pthread_join(reader, NULL))
+        errx(1, "pthread_join() failed");
+    report_destroy(&sb->b);
+
+    printf("%s:\n", sb->lockfree ? "report slot" : "device mutex");
+    print_latency("  put", sb->put, sb->nput);
+    print_latency("  put to read", sb->read, sb->nread);
+    free(sb->put);
+    free(sb->read);
+}
+
+int
+bench_slot(int argc, char* argv[])
+{
+    if (argc > 1)
+        return 0;
+    struct slot_bench sb = { .seconds = argc ? atof(argv[0]) : 5 };
+    if (sb.seconds <= 0)
+        return 0;
+    if (pthread_mutex_init(&sb.mutex, NULL) ||
+            pthread_cond_init(&sb.cond, NULL))
+        errx(1, "pthread failed");
+    for (sb.lockfree = 0; sb.lockfree < 2; sb.lockfree++)
+        slot_run(&sb);
+    return 1;
+}
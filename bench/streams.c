@@ -0,0 +1,337 @@
+// Streaming input reports from many fake controllers.
+
+#include "bench.h"
+
+#include "host.h"
+#include "loop.h"
+#include "report.h"
+#include "wrap.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+
+// bench scale [-e threads] sessions [rate [seconds]]
+//
+// Stream Sixaxis-sized input reports from many fake controllers with the
+// devices open but nobody reading, and report context switches per report on
+// the daemon side (excluding the fake controllers) and peak RSS. Compare the
+// default thread-per-channel model with the event loop, e.g. for 1, 8, 32 and
+// 128 sessions. Run once per configuration because peak RSS only grows.
+
+struct stream {
+    struct fakes fs;
+    int rate;
+    double seconds;
+    int idle; // only jitter the motion sensors
+    long reports, switches;
+    double cpu;
+};
+
+static void*
+stream_run(void* s_void)
+{
+    struct stream* s = s_void;
+    long before = switches(RUSAGE_THREAD);
+    unsigned char msg[50] = { 0xa1, 0x01 };
+    struct timespec t0, t;
+    W(clock_gettime(CLOCK_MONOTONIC, &t0));
+    t = t0;
+    unsigned noise = 1;
+    for (long tick = 0; tick < s->seconds * s->rate; tick++) {
+        if (s->idle)
+            for (int j = 0; j < 4; j++) { // around 0x200, +-1
+                noise = noise * 1103515245 + 12345;
+                int v = 0x200 + (int)(noise >> 16) % 3 - 1;
+                msg[42+2*j] = v >> 8;
+                msg[43+2*j] = v;
+            }
+        else
+            msg[4] = tick; // change some buttons
+        for (int i = 0; i < s->fs.n; i++) {
+            W(write(s->fs.f[i].intr, msg, sizeof msg));
+            s->reports++;
+        }
+        timespec_add(&t, 1000000000L / s->rate);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL))
+            ;
+    }
+    s->switches = switches(RUSAGE_THREAD) - before;
+    s->cpu = cpu(RUSAGE_THREAD);
+    return NULL;
+}
+
+int
+bench_scale(int argc, char* argv[])
+{
+    int threads = 0;
+    if (argc >= 2 && !strcmp(argv[0], "-e")) {
+        threads = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 1 || argc > 3)
+        return 0;
+    struct stream s = { { NULL, atoi(argv[0]) },
+                        argc > 1 ? atoi(argv[1]) : 100,
+                        argc > 2 ? atof(argv[2]) : 5, 0 };
+    if (s.fs.n < 1 || s.rate < 1 || s.seconds <= 0)
+        return 0;
+
+    loop_start(threads);
+    s.fs.f = fake_create(s.fs.n);
+    pthread_t ctrl_thread, stream_thread;
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &s.fs))
+        errx(1, "pthread_create() failed");
+    for (int i = 0; i < s.fs.n; i++) {
+        device_start(&s.fs.f[i].d);
+        device_open(&s.fs.f[i].d);
+    }
+
+    long before = switches(RUSAGE_SELF);
+    if (pthread_create(&stream_thread, NULL, stream_run, &s) ||
+            pthread_join(stream_thread, NULL))
+        errx(1, "pthread failed");
+    // this thread switched once to join
+    long daemon = switches(RUSAGE_SELF) - before - s.switches - 1;
+
+    struct rusage ru;
+    W(getrusage(RUSAGE_SELF, &ru));
+    printf("%s, %d sessions, %ld reports: "
+           "%.3lf switches/report, max RSS %ld KiB\n",
+           threads ? "event loop" : "threads", s.fs.n, s.reports,
+           (double)daemon / s.reports, ru.ru_maxrss);
+
+    for (int i = 0; i < s.fs.n; i++) {
+        device_disconnect(&s.fs.f[i].d);
+        device_stop(&s.fs.f[i].d);
+    }
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+    return 1;
+}
+
+// bench idle [-c threshold] [-r rate] sessions [seconds]
+//
+// Stream 100 reports per second from idle controllers, whose motion sensors
+// jitter by one count, to a blocking reader per device, and report CPU time
+// per controller on the daemon and reader side (excluding the fake
+// controllers) and reader wakeups. Compare without and with change detection,
+// and with delivery rates such as 10, 30 and 60.
+
+static void*
+idle_reader_run(void* d_void)
+{
+    struct device* d = d_void;
+    long* reads = calloc(1, sizeof *reads);
+    if (!reads)
+        err(1, "calloc() failed");
+    unsigned char buf[49];
+    size_t size;
+    while (size = sizeof buf, device_read(d, 0, buf, &size))
+        ++*reads;
+    return reads;
+}
+
+int
+bench_idle(int argc, char* argv[])
+{
+    for (; argc >= 2 && argv[0][0] == '-'; argc -= 2, argv += 2)
+        if (!strcmp(argv[0], "-c"))
+            change_threshold = atoi(argv[1]);
+        else if (!strcmp(argv[0], "-r"))
+            delivery_rate = atoi(argv[1]);
+        else
+            return 0;
+    if (argc < 1 || argc > 2 || delivery_rate < 0)
+        return 0;
+    struct stream s = { { NULL, atoi(argv[0]) }, 100,
+                        argc > 1 ? atof(argv[1]) : 5, 1 };
+    if (s.fs.n < 1 || s.seconds <= 0)
+        return 0;
+
+    s.fs.f = fake_create(s.fs.n);
+    pthread_t ctrl_thread, stream_thread;
+    pthread_t* readers = calloc(s.fs.n, sizeof *readers);
+    if (!readers)
+        err(1, "calloc() failed");
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &s.fs))
+        errx(1, "pthread_create() failed");
+    for (int i = 0; i < s.fs.n; i++) {
+        device_start(&s.fs.f[i].d);
+        device_open(&s.fs.f[i].d);
+        if (pthread_create(&readers[i], NULL, idle_reader_run, &s.fs.f[i].d))
+            errx(1, "pthread_create() failed");
+    }
+
+    double before = cpu(RUSAGE_SELF);
+    if (pthread_create(&stream_thread, NULL, stream_run, &s) ||
+            pthread_join(stream_thread, NULL))
+        errx(1, "pthread failed");
+    double used = cpu(RUSAGE_SELF) - before - s.cpu;
+
+    long reads = 0;
+    uint64_t suppressed = 0, throttled = 0;
+    for (int i = 0; i < s.fs.n; i++) {
+        struct btsixa_stats stats;
+        device_stats(&s.fs.f[i].d, &stats);
+        suppressed += stats.suppressed;
+        throttled += stats.throttled;
+        device_disconnect(&s.fs.f[i].d);
+        long* r;
+        if (pthread_join(readers[i], (void**)&r))
+            errx(1, "pthread_join() failed");
+        reads += *r;
+        free(r);
+        device_stop(&s.fs.f[i].d);
+    }
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+    free(readers);
+
+    printf("threshold %d, rate %d, %d sessions, %ld reports: %.1lf us CPU "
+           "per controller-second, %.1lf reads/s per controller, "
+           "%ju suppressed, %ju throttled\n",
+           change_threshold, delivery_rate, s.fs.n, s.reports,
+           1e6*used / s.fs.n / s.seconds, reads / s.fs.n / s.seconds,
+           (uintmax_t)suppressed, (uintmax_t)throttled);
+    return 1;
+}
+
+// bench e2e [-e threads] sessions [rate [seconds]]
+//
+// Run whole sessions in-process, from identifying the gamepad to
+// disconnecting, with fake gamepads that stream at the given rate (0 for as
+// fast as possible) once a reader opens the device. Report report-to-reader
+// latency and the rate at which readers get reports. Sessions print their
+// per-stage latency when they end. Readers use a queue of REPORT_MAX_DEPTH so
+// that the rate is only limited by the daemon.
+
+struct e2e_reader {
+    struct fake* f;
+    double seconds;
+    long reads;
+    double* latency;
+    size_t samples, max_samples;
+};
+
+static void*
+e2e_reader_run(void* r_void)
+{
+    struct e2e_reader* r = r_void;
+    struct device* d = &r->f->d;
+    while (!atomic_load(&r->f->started))
+        usleep(1000);
+    if (!device_open(d))
+        errx(1, "device_open() failed");
+    device_set_queue(d, REPORT_MAX_DEPTH);
+    unsigned char buf[REPORT_MAX_DEPTH * 49];
+    double end = now() + r->seconds;
+    for (double t = 0; t < end;) {
+        size_t size = sizeof buf;
+        if (!device_read(d, 0, buf, &size))
+            errx(1, "device_read() failed");
+        device_read_copied(d); // like cuse_copy_out() in the daemon
+        t = now();
+        for (size_t i = 0; i + 49 <= size; i += 49) {
+            double sent;
+            memcpy(&sent, buf+i+FAKE_SENT_OFFSET, sizeof sent);
+            if (r->samples < r->max_samples)
+                r->latency[r->samples++] = t - sent;
+            r->reads++;
+        }
+    }
+    device_close(d);
+    return NULL;
+}
+
+int
+bench_e2e(int argc, char* argv[])
+{
+    int threads = 0;
+    if (argc >= 2 && !strcmp(argv[0], "-e")) {
+        threads = atoi(argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 1 || argc > 3)
+        return 0;
+    struct fakes fs = { NULL, atoi(argv[0]), 0, 0.001,
+                        argc > 1 ? atoi(argv[1]) : 100 };
+    double seconds = argc > 2 ? atof(argv[2]) : 5;
+    if (fs.n < 1 || fs.rate < 0 || seconds <= 0)
+        return 0;
+    fs.flood = !fs.rate;
+
+    loop_start(threads);
+    fs.f = fake_create(fs.n);
+    struct e2e_reader* readers = calloc(fs.n, sizeof *readers);
+    pthread_t* threads_ = calloc(2*fs.n, sizeof *threads_);
+    if (!readers || !threads_)
+        err(1, "calloc() failed");
+    pthread_t ctrl_thread;
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    for (int i = 0; i < fs.n; i++) {
+        struct fake* f = &fs.f[i];
+        f->d.transport = &fake_transport;
+        f->d.driver = NULL; // up to identify
+        wp(pthread_mutex_init(&f->d.mutex, NULL)); // like the server
+        readers[i].f = f;
+        readers[i].seconds = seconds;
+        readers[i].max_samples = 1 << 20;
+        readers[i].latency =
+            malloc(readers[i].max_samples * sizeof *readers[i].latency);
+        if (!readers[i].latency)
+            err(1, "malloc() failed");
+        if (pthread_create(&threads_[2*i], NULL, e2e_session_run, &f->d) ||
+                pthread_create(&threads_[2*i+1], NULL, e2e_reader_run,
+                               &readers[i]))
+            errx(1, "pthread_create() failed");
+    }
+
+    long reads = 0, reports = 0;
+    size_t samples = 0;
+    double* latency = malloc(fs.n * (1 << 20) * sizeof *latency);
+    if (!latency)
+        err(1, "malloc() failed");
+    uint64_t overruns = 0;
+    for (int i = 0; i < fs.n; i++) {
+        if (pthread_join(threads_[2*i+1], NULL))
+            errx(1, "pthread_join() failed");
+        struct btsixa_stats stats;
+        device_stats(&fs.f[i].d, &stats);
+        overruns += stats.overruns;
+        device_disconnect(&fs.f[i].d);
+        if (pthread_join(threads_[2*i], NULL))
+            errx(1, "pthread_join() failed");
+        W(close(fs.f[i].d.intr));
+        W(close(fs.f[i].d.ctrl));
+        reads += readers[i].reads;
+        memcpy(latency+samples, readers[i].latency,
+               readers[i].samples * sizeof *latency);
+        samples += readers[i].samples;
+        free(readers[i].latency);
+    }
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+    for (int i = 0; i < fs.n; i++)
+        reports += fs.f[i].reports;
+
+    printf("%s, %d sessions: %.0lf reports/s sent and %.0lf read "
+           "per session, %ju overruns\n",
+           threads ? "event loop" : "threads", fs.n,
+           reports / seconds / fs.n, reads / seconds / fs.n,
+           (uintmax_t)overruns);
+    print_latency("report to reader", latency, samples);
+    free(latency);
+    free(threads_);
+    free(readers);
+    return 1;
+}
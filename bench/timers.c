@@ -0,0 +1,159 @@
+// Device deadlines on the timer wheel.
+
+#include "bench.h"
+
+#include "host.h"
+#include "timer.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+
+// bench timers [-c] sessions [seconds]
+//
+// Give each session a thread that waits without a timeout, as device_run does,
+// for deadlines every 10 ms to 1 s, staggered across sessions, and sets the
+// next one when woken. Report how late the wakeups were, whether any came
+// early, and CPU time per session-second. With -c each thread waits for its
+// own deadline with a timed wait instead, as before the timer thread.
+
+struct waiter {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct timer timer;
+    int timed, fired;
+    uint64_t first, period, end;
+    double* late;
+    size_t n, early;
+};
+
+static uint64_t
+clock_ns()
+{
+    struct timespec t;
+    W(clock_gettime(CLOCK_MONOTONIC, &t));
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void
+waiter_fire(void* w_void)
+{
+    struct waiter* w = w_void;
+    if (pthread_mutex_lock(&w->mutex))
+        errx(1, "pthread_mutex_lock() failed");
+    w->fired = 1;
+    if (pthread_cond_broadcast(&w->cond) ||
+            pthread_mutex_unlock(&w->mutex))
+        errx(1, "pthread failed");
+}
+
+static void*
+waiter_run(void* w_void)
+{
+    struct waiter* w = w_void;
+    if (pthread_mutex_lock(&w->mutex))
+        errx(1, "pthread_mutex_lock() failed");
+    for (uint64_t due = w->first; due < w->end; due += w->period) {
+        uint64_t t;
+        if (w->timed) {
+            struct timespec ts = { due / 1000000000, due % 1000000000 };
+            while ((t = clock_ns()) < due) {
+                int r = pthread_cond_timedwait(&w->cond, &w->mutex, &ts);
+                if (r && r != ETIMEDOUT)
+                    errx(1, "pthread_cond_timedwait() failed");
+            }
+        } else {
+            timer_set(&w->timer, due);
+            while (!w->fired)
+                if (pthread_cond_wait(&w->cond, &w->mutex))
+                    errx(1, "pthread_cond_wait() failed");
+            w->fired = 0;
+            if ((t = clock_ns()) < due)
+                w->early++;
+        }
+        w->late[w->n++] = 1e-9 * (t - due);
+    }
+    if (pthread_mutex_unlock(&w->mutex))
+        errx(1, "pthread_mutex_unlock() failed");
+    return NULL;
+}
+
+int
+bench_timers(int argc, char* argv[])
+{
+    int timed = argc >= 1 && !strcmp(argv[0], "-c");
+    if (timed) {
+        argc--;
+        argv++;
+    }
+    if (argc < 1 || argc > 2)
+        return 0;
+    int n = atoi(argv[0]);
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    if (n < 1 || seconds <= 0)
+        return 0;
+
+    struct waiter* w = calloc(n, sizeof *w);
+    pthread_t* threads = calloc(n, sizeof *threads);
+    if (!w || !threads)
+        err(1, "calloc() failed");
+    pthread_condattr_t condattr;
+    if (pthread_condattr_init(&condattr) ||
+            pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC))
+        errx(1, "pthread_condattr failed");
+    uint64_t t0 = clock_ns() + 100000000, end = t0 + seconds * 1e9;
+    size_t samples = 0;
+    for (int i = 0; i < n; i++) {
+        w[i].timed = timed;
+        w[i].period = (10 + (uint64_t)i * 7919 % 991) * 1000000;
+        w[i].first = t0 + w[i].period * i / n;
+        w[i].end = end;
+        w[i].late = calloc(seconds * 1e9 / w[i].period + 1, sizeof *w->late);
+        if (!w[i].late)
+            err(1, "calloc() failed");
+        timer_init(&w[i].timer, waiter_fire, &w[i]);
+        if (pthread_mutex_init(&w[i].mutex, NULL) ||
+                pthread_cond_init(&w[i].cond, &condattr))
+            errx(1, "pthread failed");
+    }
+    double before = cpu(RUSAGE_SELF);
+    for (int i = 0; i < n; i++)
+        if (pthread_create(&threads[i], NULL, waiter_run, &w[i]))
+            errx(1, "pthread_create() failed");
+    for (int i = 0; i < n; i++)
+        if (pthread_join(threads[i], NULL))
+            errx(1, "pthread_join() failed");
+    double used = cpu(RUSAGE_SELF) - before;
+
+    double* late = calloc(1, sizeof *late);
+    size_t early = 0;
+    for (int i = 0; i < n; i++) {
+        timer_drain(&w[i].timer);
+        late = realloc(late, (samples + w[i].n + 1) * sizeof *late);
+        if (!late)
+            err(1, "realloc() failed");
+        memcpy(late + samples, w[i].late, w[i].n * sizeof *late);
+        samples += w[i].n;
+        early += w[i].early;
+        free(w[i].late);
+        pthread_cond_destroy(&w[i].cond);
+        pthread_mutex_destroy(&w[i].mutex);
+    }
+    pthread_condattr_destroy(&condattr);
+
+    printf("%s, %d sessions, %zu deadlines: %.1lf us CPU per "
+           "session-second, %zu early\n",
+           timed ? "timed waits" : "timer wheel", n, samples,
+           1e6*used / n / seconds, early);
+    print_latency("lateness", late, samples);
+    free(late);
+    free(threads);
+    free(w);
+    return 1;
+}
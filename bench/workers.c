@@ -0,0 +1,164 @@
+// Serving blocking readers and ioctls from the worker pool.
+
+#include "bench.h"
+
+#include "pool.h"
+#include "wrap.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/queue.h>
+
+
+// bench workers [-f] readers [seconds]
+//
+// Drive the worker pool the way cuse does, through a queue of requests, with
+// a blocking reader per fake gamepad streaming 10 reports/s and an ioctl
+// client asking for statistics every millisecond. Report how long the ioctls
+// take, including waiting for a worker, and the most workers used. With -f
+// the pool stays at its initial 4 workers, like before it could grow.
+
+struct request {
+    struct device* d;
+    int read; // else BTSIXA_GET_STATS
+    int done;
+    TAILQ_ENTRY(request) next;
+};
+
+static TAILQ_HEAD(, request) requests = TAILQ_HEAD_INITIALIZER(requests);
+static pthread_mutex_t requests_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requests_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static struct pool bench_pool;
+
+static int
+fake_wait_and_process()
+{
+    wp(pthread_mutex_lock(&requests_mutex));
+    while (TAILQ_EMPTY(&requests))
+        wp(pthread_cond_wait(&requests_cond, &requests_mutex));
+    struct request* r = TAILQ_FIRST(&requests);
+    TAILQ_REMOVE(&requests, r, next);
+    wp(pthread_mutex_unlock(&requests_mutex));
+
+    pool_enter(&bench_pool);
+    if (r->read) {
+        unsigned char buf[49];
+        size_t size = sizeof buf;
+        device_read(r->d, 0, buf, &size);
+    } else {
+        struct btsixa_stats stats;
+        device_stats(r->d, &stats);
+    }
+    pool_leave(&bench_pool);
+
+    wp(pthread_mutex_lock(&requests_mutex));
+    r->done = 1;
+    wp(pthread_cond_broadcast(&done_cond));
+    wp(pthread_mutex_unlock(&requests_mutex));
+    return 0;
+}
+
+static void
+request(struct request* r)
+{
+    r->done = 0;
+    wp(pthread_mutex_lock(&requests_mutex));
+    TAILQ_INSERT_TAIL(&requests, r, next);
+    wp(pthread_cond_signal(&requests_cond));
+    while (!r->done)
+        wp(pthread_cond_wait(&done_cond, &requests_mutex));
+    wp(pthread_mutex_unlock(&requests_mutex));
+}
+
+struct blocking_reader {
+    struct request r;
+    double end;
+    long reads;
+};
+
+static void*
+blocking_reader_run(void* b_void)
+{
+    struct blocking_reader* b = b_void;
+    while (now() < b->end) {
+        request(&b->r);
+        b->reads++;
+    }
+    return NULL;
+}
+
+int
+bench_workers(int argc, char* argv[])
+{
+    int fixed = 0;
+    if (argc >= 1 && !strcmp(argv[0], "-f")) {
+        fixed = 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 1 || argc > 2)
+        return 0;
+    struct fakes fs = { NULL, atoi(argv[0]), 0, 0.001, 10 };
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    if (fs.n < 1 || seconds <= 0)
+        return 0;
+
+    bench_pool = (struct pool){ fake_wait_and_process, 4, fixed ? 4 : 256 };
+    pool_start(&bench_pool);
+    fs.f = fake_create(fs.n);
+    pthread_t ctrl_thread;
+    if (pthread_create(&ctrl_thread, NULL, fake_run, &fs))
+        errx(1, "pthread_create() failed");
+    struct blocking_reader* readers = calloc(fs.n, sizeof *readers);
+    pthread_t* threads = calloc(fs.n, sizeof *threads);
+    if (!readers || !threads)
+        err(1, "calloc() failed");
+    double end = now() + seconds;
+    for (int i = 0; i < fs.n; i++) {
+        device_start(&fs.f[i].d);
+        device_open(&fs.f[i].d);
+        readers[i].r = (struct request){ &fs.f[i].d, 1 };
+        readers[i].end = end;
+        if (pthread_create(&threads[i], NULL, blocking_reader_run,
+                           &readers[i]))
+            errx(1, "pthread_create() failed");
+    }
+
+    size_t max_samples = seconds * 1000 + 1, samples = 0;
+    double* latency = malloc(max_samples * sizeof *latency);
+    if (!latency)
+        err(1, "malloc() failed");
+    for (double t = now(); t < end && samples < max_samples; t = now()) {
+        struct request r = { &fs.f[samples % fs.n].d, 0 };
+        request(&r);
+        latency[samples++] = now() - t;
+        usleep(1000);
+    }
+
+    long reads = 0;
+    for (int i = 0; i < fs.n; i++) {
+        device_disconnect(&fs.f[i].d); // wakes up a blocked read
+        if (pthread_join(threads[i], NULL))
+            errx(1, "pthread_join() failed");
+        reads += readers[i].reads;
+    }
+    if (pthread_join(ctrl_thread, NULL))
+        errx(1, "pthread_join() failed");
+    for (int i = 0; i < fs.n; i++)
+        device_stop(&fs.f[i].d);
+
+    printf("%s pool, %d blocking readers: %.1lf reads/s per reader, "
+           "%d workers at most\n", fixed ? "fixed" : "growing", fs.n,
+           reads / seconds / fs.n, bench_pool.peak);
+    print_latency("ioctl", latency, samples);
+    free(latency);
+    free(threads);
+    free(readers);
+    return 1;
+}
@@ -0,0 +1,80 @@
+#ifndef BTSIXA_H
+#define BTSIXA_H
+
+// Extensions to the uhid interface of btsixa* devices.
+
+#include <stdint.h>
+#include <sys/ioccom.h>
+
+// Queue up to this many input reports (at most 128) instead of keeping only
+// the latest one, until the device is closed. A read returns as many whole
+// reports as fit in the buffer.
+#define BTSIXA_SET_QUEUE _IOW('B', 1, int)
+
+struct btsixa_stats {
+    uint64_t reports; // input reports received since connecting
+    uint64_t overruns; // input reports skipped because the queue was full
+    uint64_t suppressed; // input reports not delivered because unchanged
+    uint64_t throttled; // input reports replaced by a later one, see below
+    uint64_t output_sent; // output reports sent to the device
+    uint64_t output_coalesced; // writes unchanged or superseded before sent
+};
+
+#define BTSIXA_GET_STATS _IOR('B', 2, struct btsixa_stats)
+
+// Answer GET_REPORT for input reports and feature reports that don't change
+// without asking the device (default unless btsixad -n), until closed.
+#define BTSIXA_SET_CACHE _IOW('B', 3, int)
+
+// Only deliver input reports in which buttons or sticks changed or a motion
+// sensor moved by more than this since the last one delivered, or all input
+// reports if -1 (default unless btsixad -c), until closed.
+#define BTSIXA_SET_THRESHOLD _IOW('B', 4, int)
+
+// Deliver at most this many input reports a second, each the latest, or all
+// if 0 (default unless btsixad -r), until closed. Changes of buttons are
+// delivered right away.
+#define BTSIXA_SET_RATE _IOW('B', 6, int)
+
+// Rumble in steps timed by the daemon, then stop, replacing any effect being
+// played. No steps stop the effect, as does closing the device. The steps are
+// sent as output reports no more often than btsixad -o allows. Fails with
+// EINVAL for devices that can't rumble.
+#define BTSIXA_EFFECT_STEPS 32
+
+struct btsixa_effect_step {
+    uint8_t weak; // small motor, only on or off for the Sixaxis
+    uint8_t strong; // large motor force
+    uint16_t ms; // until the next step
+};
+
+struct btsixa_effect {
+    uint32_t n_steps;
+    struct btsixa_effect_step steps[BTSIXA_EFFECT_STEPS];
+};
+
+#define BTSIXA_PLAY_EFFECT _IOW('B', 5, struct btsixa_effect)
+
+// Whether the link seems lost, with btsixad -g: the gamepad streams input
+// reports while the device is open, and none arrived for the gap given. The
+// last report read stays the state until then, so a game can pause instead.
+struct btsixa_status {
+    uint32_t stalled; // cleared when reports arrive again
+    uint32_t silence; // milliseconds since the last input report, with -g
+};
+
+#define BTSIXA_GET_STATUS _IOR('B', 7, struct btsixa_status)
+
+// Reading btsixamux returns as many whole records as fit in the buffer, each
+// this header followed by an input report of any btsixa* device, padded to a
+// multiple of BTSIXA_MUX_ALIGN bytes. Only the latest report of each device is
+// returned, and a record of size 0 means the device is gone.
+struct btsixa_mux_record {
+    int32_t unit; // of btsixaN
+    uint32_t size; // of the report, truncated if a single record didn't fit
+    uint64_t seq; // reports from the device up to this one
+};
+
+#define BTSIXA_MUX_ALIGN 8
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef BTSIXA_SHM_H
+#define BTSIXA_SHM_H
+
+// Reading the latest input report of each btsixa* device from the shared
+// memory published by btsixad -m, without system calls.
+//
+//     struct btsixa_shm* shm = btsixa_shm_open("/btsixad");
+//     struct btsixa_shm_slot s;
+//     if (shm && btsixa_shm_get(shm, unit, &s))
+//         ... s.report, s.size, s.seq, s.received ...
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define BTSIXA_SHM_MAGIC 0x62743661 // "bt6a"
+#define BTSIXA_SHM_VERSION 1
+#define BTSIXA_SHM_SLOTS 32 // for units 0 to 31
+#define BTSIXA_SHM_REPORT_SIZE 64 // longer reports are truncated
+
+struct btsixa_shm_slot {
+    uint32_t lock; // odd while being written
+    uint32_t size; // of the report, 0 if there is no device
+    uint64_t seq; // reports from the device up to this one
+    uint64_t received; // CLOCK_MONOTONIC nanoseconds
+    unsigned char report[BTSIXA_SHM_REPORT_SIZE];
+};
+
+struct btsixa_shm {
+    uint32_t magic, version;
+    int32_t pid; // of btsixad, which recreates the memory when restarted
+    uint32_t n_slots;
+    struct btsixa_shm_slot slots[BTSIXA_SHM_SLOTS];
+};
+
+static inline struct btsixa_shm*
+btsixa_shm_open(const char* name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return NULL;
+    void* p = mmap(NULL, sizeof(struct btsixa_shm), PROT_READ, MAP_SHARED,
+                   fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    struct btsixa_shm* shm = (struct btsixa_shm*)p;
+    if (shm->magic != BTSIXA_SHM_MAGIC ||
+            shm->version != BTSIXA_SHM_VERSION) {
+        munmap(p, sizeof *shm);
+        return NULL;
+    }
+    return shm;
+}
+
+static inline void
+btsixa_shm_close(struct btsixa_shm* shm)
+{
+    munmap(shm, sizeof *shm);
+}
+
+// Copy a consistent state of the slot. Returns 0 if there is no device.
+static inline int
+btsixa_shm_get(const struct btsixa_shm* shm, int unit,
+               struct btsixa_shm_slot* copy)
+{
+    if (unit < 0 || (uint32_t)unit >= shm->n_slots)
+        return 0;
+    const struct btsixa_shm_slot* slot = &shm->slots[unit];
+    for (;;) {
+        uint32_t lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+        if (lock & 1)
+            continue; // being written, which is quick
+        memcpy(copy, slot, sizeof *copy);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == lock)
+            break;
+    }
+    if (copy->size > BTSIXA_SHM_REPORT_SIZE)
+        copy->size = BTSIXA_SHM_REPORT_SIZE;
+    return copy->size != 0;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include "capture.h"
+
+#include "logger.h"
+#include "wrap.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// Messages are copied into a preallocated ring under a mutex that is held
+// only for the copy, and a thread writes them out. If the ring is full,
+// records are dropped and counted rather than making the channel wait for
+// the disk.
+
+#define CAPTURE_RING_SIZE (1 << 20)
+
+static int capture_fd = -1;
+static unsigned char* ring;
+static size_t head, tail; // total bytes put and written
+static uint64_t dropped, reported;
+static int flusher_waiting;
+static atomic_int stopped; // after a failed write
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static void
+ring_copy(size_t at, const void* data, size_t size)
+{
+    size_t i = at % CAPTURE_RING_SIZE, k = CAPTURE_RING_SIZE - i;
+    if (k > size)
+        k = size;
+    memcpy(ring+i, data, k);
+    memcpy(ring, (const unsigned char*)data+k, size-k);
+}
+
+static void*
+flusher_run(void* _)
+{
+    wp(pthread_mutex_lock(&mutex));
+    for (;;) {
+        while (head == tail) {
+            flusher_waiting = 1;
+            wp(pthread_cond_wait(&cond, &mutex));
+        }
+        // Only this thread advances tail, so the bytes up to head stay put
+        // while written without the mutex.
+        size_t i = tail % CAPTURE_RING_SIZE, n = head - tail;
+        if (n > CAPTURE_RING_SIZE - i)
+            n = CAPTURE_RING_SIZE - i;
+        wp(pthread_mutex_unlock(&mutex));
+        ssize_t w;
+        do
+            w = write(capture_fd, ring+i, n);
+        while (w == -1 && errno == EINTR);
+        if (w <= 0) {
+            if (!w)
+                errno = EIO;
+            break;
+        }
+        wp(pthread_mutex_lock(&mutex));
+        tail += w;
+        if (dropped != reported) {
+            logger_printf(LOG_WARNING, "capture: %ju records dropped so far",
+                          (uintmax_t)dropped);
+            reported = dropped;
+        }
+    }
+
+    // The trace is only for diagnosis, so a full disk ends it, not the
+    // daemon.
+    logger_printf(LOG_ERR, "capture: write failed, stopped: %s",
+                  strerror(errno));
+    atomic_store(&stopped, 1);
+    close(capture_fd);
+    return NULL;
+}
+
+// Before daemon(), so that the path may be relative.
+void
+capture_init(const char* path)
+{
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (capture_fd == -1)
+        err(1, "%s", path);
+    if (WR(write(capture_fd, CAPTURE_MAGIC, sizeof CAPTURE_MAGIC - 1)) !=
+            sizeof CAPTURE_MAGIC - 1)
+        errx(1, "%s: write failed", path);
+    ring = wm(malloc(CAPTURE_RING_SIZE));
+}
+
+void
+capture_start()
+{
+    if (capture_fd == -1)
+        return;
+    pthread_t thread;
+    wp(pthread_create(&thread, NULL, flusher_run, NULL));
+    wp(pthread_detach(thread));
+}
+
+void
+capture_message(const bdaddr_t* bdaddr, int send, int ctrl,
+                unsigned char message, const unsigned char* data, size_t size)
+{
+    if (capture_fd == -1 ||
+            atomic_load_explicit(&stopped, memory_order_relaxed))
+        return;
+
+    struct capture_record r = { 0 };
+    struct timespec t;
+    we(clock_gettime(CLOCK_MONOTONIC, &t));
+    r.time = (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+    memcpy(r.bdaddr, bdaddr, sizeof r.bdaddr);
+    r.flags = (send ? CAPTURE_SEND : 0) | (ctrl ? CAPTURE_CTRL : 0);
+    r.message = message;
+    r.size = size;
+
+    wp(pthread_mutex_lock(&mutex));
+    if (head - tail + sizeof r + size > CAPTURE_RING_SIZE)
+        dropped++;
+    else {
+        ring_copy(head, &r, sizeof r);
+        ring_copy(head + sizeof r, data, size);
+        head += sizeof r + size;
+        if (flusher_waiting) {
+            flusher_waiting = 0;
+            wp(pthread_cond_signal(&cond));
+        }
+    }
+    wp(pthread_mutex_unlock(&mutex));
+}
@@ -0,0 +1,32 @@
+#ifndef BTSIXAD_CAPTURE_H
+#define BTSIXAD_CAPTURE_H
+
+#define L2CAP_SOCKET_CHECKED
+#include <bluetooth.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A trace file starts with CAPTURE_MAGIC and is followed by records, each a
+// header and size bytes of message data, in host byte order.
+
+#define CAPTURE_MAGIC "btsixa\0\1"
+
+#define CAPTURE_SEND 1 // from the daemon to the device, else received
+#define CAPTURE_CTRL 2 // on the control channel, else interrupt
+
+struct capture_record {
+    uint64_t time; // CLOCK_MONOTONIC in ns
+    uint8_t bdaddr[6];
+    uint8_t flags;
+    uint8_t message; // the HIDP header byte
+    uint32_t size;
+    uint32_t reserved;
+};
+
+void capture_init(const char* path);
+void capture_start();
+void capture_message(const bdaddr_t* bdaddr, int send, int ctrl,
+                     unsigned char message,
+                     const unsigned char* data, size_t size);
+
+#endif
@@ -1,16 +1,24 @@
 #include "device.h"
 
+#include "capture.h"
+#include "hid.h"
 #include "host.h"
+#include "logger.h"
+#include "loop.h"
+#include "mux.h"
+#include "pnp.h"
+#include "shm.h"
 #include "sixaxis.h"
+#include "timer.h"
 #include "vuhid.h"
 #include "wrap.h"
 
 #include <assert.h>
 #include <bluetooth.h>
 #include <err.h>
+#include <errno.h>
 #include <pthread.h>
 #include <sdp.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
@@ -21,16 +29,33 @@
 #include <dev/usb/usbhid.h>
 
 
-static void
-query_sdp(struct device* d)
+static void*
+open_sdp(const bdaddr_t* remote)
 {
+    char buf[32];
     bdaddr_t l;
     bdaddr_copy(&l, &bdaddr);
-    void* xs = sdp_open(&l, &d->bdaddr);
+    void* xs = sdp_open(&l, remote);
+    if (!xs || sdp_error(xs)) {
+        logger_printf(LOG_WARNING, "%s: sdp_open() failed: %s",
+                      bt_ntoa(remote, buf),
+                      strerror(xs ? sdp_error(xs) : ENOMEM));
+        if (xs)
+            sdp_close(xs);
+        return NULL;
+    }
+    return xs;
+}
+
+// Failures are only logged, since this also checks cached answers in the
+// background, and the device is then taken for an unknown one.
+static int
+query_sdp(const bdaddr_t* remote, struct pnp_info* info)
+{
+    char buf[32];
+    void* xs = open_sdp(remote);
     if (!xs)
-        errx(1, "sdp_open() failed");
-    if (sdp_error(xs))
-        errc(1, sdp_error(xs), "sdp_open() failed");
+        return 0;
 
     unsigned char v[4][3]; // max size is uint16
     sdp_attr_t attrs[4];
@@ -45,10 +70,14 @@ query_sdp(struct device* d)
         SDP_ATTR_RANGE(0x0201, 0x0203),
         SDP_ATTR_RANGE(0x0205, 0x0205)
     };
-    if (sdp_search(xs, 1, &serv, 2, ranges, 4, attrs))
-        errc(1, sdp_error(xs), "sdp_search()");
-    if (sdp_close(xs))
-        errx(1, "sdp_close()");
+    int r = sdp_search(xs, 1, &serv, 2, ranges, 4, attrs);
+    int error = sdp_error(xs);
+    sdp_close(xs);
+    if (r) {
+        logger_printf(LOG_WARNING, "%s: sdp_search() failed: %s",
+                      bt_ntoa(remote, buf), strerror(error));
+        return 0;
+    }
 
     uint16_t id[5] = {}; // vendor, product, release, _, source
     for (int i = 0; i < 4; i++)
@@ -56,29 +85,199 @@ query_sdp(struct device* d)
                 (attrs[i].attr >= 0x0201 && attrs[i].attr <= 0x0205) &&
                 attrs[i].vlen == 3 && v[i][0] == 0x09) // uint16
             id[attrs[i].attr-0x0201] = v[i][1] << 8 | v[i][2];
+    *info = (struct pnp_info){ id[0], id[1], id[2], id[4] };
+    return 1;
+}
 
-    d->sixaxis = id[4] == 2 /* USB */ && id[0] == 0x054c && id[1] == 0x0268;
-    d->model = d->sixaxis ? "Sixaxis gamepad" : "unknown device";
+// The report descriptor of a device other than the Sixaxis, compiled if it is
+// a joystick or gamepad we can present.
+static struct hid_plan*
+query_hid(const bdaddr_t* remote)
+{
+    char buf[32];
+    void* xs = open_sdp(remote);
+    if (!xs)
+        return NULL;
+
+    unsigned char v[2048];
+    sdp_attr_t attr;
+    attr.flags = SDP_ATTR_INVALID;
+    attr.vlen = sizeof v;
+    attr.value = v;
+    uint16_t serv = SDP_SERVICE_CLASS_HUMAN_INTERFACE_DEVICE;
+    uint32_t range = SDP_ATTR_RANGE(0x0206, 0x0206); // HIDDescriptorList
+    int r = sdp_search(xs, 1, &serv, 1, &range, 1, &attr);
+    int error = sdp_error(xs);
+    sdp_close(xs);
+    if (r) {
+        logger_printf(LOG_WARNING, "%s: sdp_search() failed: %s",
+                      bt_ntoa(remote, buf), strerror(error));
+        return NULL;
+    }
 
-    syslog(LOG_DEBUG, "connection is from %s: "
-           "vendor 0x%04x (by 0x%04x), product 0x%04x, release 0x%04x",
-           d->model, id[0], id[4], id[1], id[2]);
+    const unsigned char* data;
+    size_t size;
+    const char* reason = "no report descriptor";
+    struct hid_plan* p = NULL;
+    if (attr.flags == SDP_ATTR_OK &&
+            hid_sdp_descriptor(v, attr.vlen, &data, &size))
+        p = hid_compile(data, size, &reason);
+    if (!p) {
+        logger_printf(LOG_NOTICE, "%s: not using HID device: %s",
+                      bt_ntoa(remote, buf), reason);
+        return NULL;
+    }
+    int buttons, hat, axes;
+    hid_summary(p, &buttons, &hat, &axes);
+    logger_printf(LOG_DEBUG, "HID device has %d buttons, %s hat switch "
+                  "and %d axes", buttons, hat ? "a" : "no", axes);
+    return p;
 }
 
+// Models known by their USB vendor and product IDs.
+static const struct {
+    uint16_t vendor, product;
+    const struct driver* driver;
+} drivers[] = {
+    { 0x054c, 0x0268, &sixaxis_driver },
+    { 0x054c, 0x042f, &navigation_driver },
+};
+
+void
+device_identify(struct device* d, const struct pnp_info* info)
+{
+    d->driver = NULL;
+    for (size_t i = 0; i < sizeof drivers / sizeof *drivers; i++)
+        if (info->source == 2 /* USB */ &&
+                info->vendor == drivers[i].vendor &&
+                info->product == drivers[i].product)
+            d->driver = drivers[i].driver;
+    d->model = d->driver ? d->driver->model : "unknown device";
+
+    logger_printf(LOG_DEBUG, "connection is from %s: "
+                  "vendor 0x%04x (by 0x%04x), product 0x%04x, release 0x%04x",
+                  d->model, info->vendor, info->source, info->product,
+                  info->release);
+}
 
 static void
-reflect_state(struct device* d, int opened)
+identify_sdp(struct device* d)
 {
-    if (d->sixaxis) {
-        if (d->unit >= 0)
-            // uhid1 is LED 1
-            sixaxis_leds(d, 1 << d->unit % 4, !opened);
-        else
-            sixaxis_leds(d, 0xf, 1);
-        sixaxis_operational(d, opened || dflag > 2);
+    struct pnp_info info = { 0 };
+    pnp_lookup(&d->bdaddr, &info, query_sdp);
+    device_identify(d, &info);
+    if (!d->driver && (d->hid = query_hid(&d->bdaddr))) {
+        d->driver = &hid_driver;
+        d->model = hid_driver.model;
     }
 }
 
+// HIDP allows only one control transaction at a time, and the Sixaxis answers
+// or drops any more unpredictably.
+const struct transport bluetooth_transport =
+    { identify_sdp, writev, readv, 1 };
+
+
+static const clockid_t timed_clock = CLOCK_MONOTONIC;
+
+static uint64_t
+clock_now()
+{
+    struct timespec t;
+    we(clock_gettime(timed_clock, &t));
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+// A gamepad that streams input reports while open is stalled when none arrive
+// for stall_gap milliseconds, long before the link times out. The timer is
+// only set again when it fires, from the time of the last report, so reports
+// only store the time. Depending on stall_action, reads then fail until
+// reports arrive again, or the device is disconnected.
+
+static void
+watchdog_fire(void* d_void)
+{
+    struct device* d = d_void;
+    if (!atomic_load(&d->watching) || atomic_load(&d->stalled))
+        return;
+    uint64_t due = atomic_load_explicit(&d->arrived, memory_order_relaxed) +
+                   (uint64_t)stall_gap * 1000000;
+    if (clock_now() < due) {
+        timer_set(&d->watchdog, due);
+        return;
+    }
+    atomic_store(&d->stalled, 1);
+    char buf[32];
+    logger_printf(LOG_NOTICE, "%s: no input reports for %d ms, stalled",
+                  bt_ntoa(&d->bdaddr, buf), stall_gap);
+    if (stall_action == 1) {
+        report_stall(&d->input, 1);
+        vuhid_wakeup();
+    } else if (stall_action == 2)
+        device_disconnect(d);
+}
+
+static void
+watchdog_watch(struct device* d, int watch)
+{
+    if (!stall_gap || !d->driver->streams)
+        return;
+    atomic_store(&d->watching, watch);
+    if (atomic_exchange(&d->stalled, 0) && stall_action == 1)
+        report_stall(&d->input, 0);
+    if (watch) {
+        // from now, for the first report
+        uint64_t now = clock_now();
+        atomic_store(&d->arrived, now);
+        timer_set(&d->watchdog, now + (uint64_t)stall_gap * 1000000);
+    } else
+        timer_unset(&d->watchdog);
+}
+
+// For each input report, with stall_gap.
+static void
+watchdog_feed(struct device* d, uint64_t received)
+{
+#ifdef BTSIXAD_NO_TIMING
+    received = clock_now();
+#endif
+    atomic_store_explicit(&d->arrived, received, memory_order_relaxed);
+    if (!atomic_load_explicit(&d->stalled, memory_order_relaxed) ||
+            !atomic_exchange(&d->stalled, 0))
+        return;
+    char buf[32];
+    logger_printf(LOG_NOTICE, "%s: input reports resumed",
+                  bt_ntoa(&d->bdaddr, buf));
+    if (stall_action == 1)
+        report_stall(&d->input, 0);
+    if (atomic_load(&d->watching))
+        timer_set(&d->watchdog, received + (uint64_t)stall_gap * 1000000);
+}
+
+void
+device_status(struct device* d, struct btsixa_status* status)
+{
+    status->stalled = atomic_load(&d->stalled);
+    status->silence = 0;
+    if (stall_gap && atomic_load(&d->watching))
+        status->silence = (clock_now() - atomic_load(&d->arrived)) / 1000000;
+}
+
+
+
+static void
+reflect_state(struct device* d, int opened)
+{
+    const struct driver* driver = d->driver;
+    if (driver->leds)
+        driver->leds(d, opened);
+    void (*hook)(struct device* d) = opened ? driver->open : driver->close;
+    if (hook)
+        hook(d);
+    watchdog_watch(d, opened);
+}
+
 int
 device_open(struct device* d)
 {
@@ -87,7 +286,14 @@ device_open(struct device* d)
     if (d->state == 0) {
         d->state = 1;
         d->timeout_running = 0;
-        d->intr_report.size = 0;
+        report_set_depth(&d->input, queue_depth);
+        report_discard(&d->input);
+        atomic_store(&d->cache, report_cache);
+        d->recent_size = 0;
+        atomic_store(&d->threshold, change_threshold);
+        atomic_store(&d->rate, delivery_rate);
+        d->throttle.next = 0;
+        d->throttle.held_size = 0;
         r = 1;
         wp(pthread_cond_broadcast(&d->cond));
     }
@@ -100,12 +306,32 @@ device_open(struct device* d)
 void
 device_close(struct device* d)
 {
-    reflect_state(d, 0);
+    reflect_state(d, atomic_load(&d->watched));
     wp(pthread_mutex_lock(&d->mutex));
     if (d->state == 1)
         d->state = 0;
+    atomic_store(&d->cache, 0);
+    if (d->effect.step >= 0) { // stop now
+        d->effect.n = d->effect.step = 0;
+        d->effect.due = 0;
+    }
+    wp(pthread_cond_broadcast(&d->cond));
+    wp(pthread_mutex_unlock(&d->mutex));
+}
+
+// The aggregate node keeps the gamepad reporting and from timing out, without
+// affecting the state of its own node.
+void
+device_watch(struct device* d, int watch)
+{
+    wp(pthread_mutex_lock(&d->mutex));
+    atomic_store(&d->watched, watch);
+    if (watch)
+        d->timeout_running = 0;
+    int opened = watch || d->state == 1;
     wp(pthread_cond_broadcast(&d->cond));
     wp(pthread_mutex_unlock(&d->mutex));
+    reflect_state(d, opened);
 }
 
 void
@@ -115,34 +341,41 @@ device_disconnect(struct device* d)
     d->state = -1;
     wp(pthread_cond_broadcast(&d->cond));
     wp(pthread_mutex_unlock(&d->mutex));
+    report_close(&d->input);
 
     // close() would introduce a race condition on the file descriptor number
     shutdown(d->intr, SHUT_RDWR);
     shutdown(d->ctrl, SHUT_RDWR);
 }
 
+void
+device_wakeup(struct device* d)
+{
+    wp(pthread_mutex_lock(&d->mutex));
+    wp(pthread_cond_broadcast(&d->cond));
+    wp(pthread_mutex_unlock(&d->mutex));
+    report_wakeup(&d->input);
+}
+
 
 static void
 print_message(struct device* d, int send, int ctrl, unsigned char message,
               unsigned char* data, size_t size)
 {
-    // NOTE: this doesn't prevent overlapping output for different devices
-    wp(pthread_mutex_lock(&d->mutex));
-    if (ctrl || dflag > 1 || !(d->d_printed & 1 << send)) {
-        printf("%s %s message 0x%02x and %zd bytes",
-               (send ? "sending" : "received"),
-               (ctrl ? "control" : "interrupt"), message, size);
-        if (size)
-            printf(": 0x");
-        for (size_t i = 0; i < size; i++)
-            printf("%02x", data[i]);
-        printf("\n");
-    }
-    if (!(ctrl || dflag > 1 || (d->d_printed & 1 << send))) {
-        printf("(use -dd to print subsequent interrupt messages)\n");
-        d->d_printed |= 1 << send;
+    int first = 0;
+    if (!ctrl && dflag < 2) {
+        first = !(atomic_fetch_or(&d->d_printed, 1 << send) & 1 << send);
+        if (!first)
+            return;
     }
-    wp(pthread_mutex_unlock(&d->mutex));
+    logger_hex(LOGGER_STDOUT, data, size,
+               "%s %s message 0x%02x and %zd bytes%s",
+               (send ? "sending" : "received"),
+               (ctrl ? "control" : "interrupt"), message, size,
+               size ? ": 0x" : "");
+    if (first)
+        logger_printf(LOGGER_STDOUT,
+                      "(use -dd to print subsequent interrupt messages)");
 }
 
 static int
@@ -151,9 +384,10 @@ send_message(struct device* d, int ctrl, unsigned char message,
 {
     if (dflag)
         print_message(d, 1, ctrl, message, data, size);
+    capture_message(&d->bdaddr, 1, ctrl, message, data, size);
 
     struct iovec iov[2] = { { &message, 1 }, { data, size } };
-    ssize_t w = WR(writev(ctrl ? d->ctrl : d->intr, iov, 2));
+    ssize_t w = WR(d->transport->send(ctrl ? d->ctrl : d->intr, iov, 2));
     if (!w || w-1 < size) {
         device_disconnect(d);
         return 0;
@@ -166,7 +400,7 @@ recv_message(struct device* d, int ctrl, unsigned char* message,
              unsigned char* data, size_t* size)
 {
     struct iovec iov[2] = { { message, 1 }, { data, *size } };
-    ssize_t r = WR(readv(ctrl ? d->ctrl : d->intr, iov, 2));
+    ssize_t r = WR(d->transport->recv(ctrl ? d->ctrl : d->intr, iov, 2));
     if (!r--) {
         device_disconnect(d);
         return 0;
@@ -174,298 +408,893 @@ recv_message(struct device* d, int ctrl, unsigned char* message,
     *size = r;
     if (dflag)
         print_message(d, 0, ctrl, *message, data, *size);
+    capture_message(&d->bdaddr, 0, ctrl, *message, data, *size);
     return 1;
 }
 
 
-static const clockid_t timed_clock = CLOCK_MONOTONIC;
-static const long nsec = 1000000000L;
 
-static void
-timed_wait(struct device* d)
+// Timestamps of input reports at each stage, compiled out with
+// BTSIXAD_NO_TIMING. A reader thread remembers when it got the first report
+// of a read until the report is copied out.
+
+#ifdef BTSIXAD_NO_TIMING
+#define timing_now() 0
+#define timing_add(d, stage, from, to) ((void)0)
+#else
+#define timing_now() clock_now()
+
+#define timing_add(d, stage, from, to) \
+    histogram_add(&(d)->stages[stage], (to) - (from))
+
+static _Thread_local struct report_stamp read_stamp; // received and got
+
+static const char* stage_names[STAGES] =
+    { "recv", "process", "publish", "wakeup", "copy", "total" };
+#endif
+
+void
+device_print_timing(struct device* d, int priority)
 {
-    struct timespec abstime;
-    we(clock_gettime(timed_clock, &abstime));
-    abstime.tv_nsec += nsec / 10;
-    abstime.tv_sec += abstime.tv_nsec / nsec;
-    abstime.tv_nsec %= nsec;
-    int r = pthread_cond_timedwait(&d->cond, &d->mutex, &abstime);
-    if (r != ETIMEDOUT)
-        wp(r);
+    char buf[32];
+#ifndef BTSIXAD_NO_TIMING
+    for (int i = 0; i < STAGES; i++) {
+        struct histogram* h = &d->stages[i];
+        uint64_t n = histogram_total(h);
+        if (n)
+            logger_printf(priority, "%s %s: p50 %.1f us, p99 %.1f us, "
+                          "max %.1f us (%ju reports)",
+                          bt_ntoa(&d->bdaddr, buf), stage_names[i],
+                          1e-3*histogram_quantile(h, .5),
+                          1e-3*histogram_quantile(h, .99),
+                          1e-3*histogram_max(h), (uintmax_t)n);
+    }
+#endif
+    uint64_t sent = atomic_load(&d->output.sent);
+    uint64_t coalesced = atomic_load(&d->output.coalesced);
+    if (sent || coalesced)
+        logger_printf(priority, "%s output: %ju reports sent, %ju writes "
+                      "coalesced", bt_ntoa(&d->bdaddr, buf), (uintmax_t)sent,
+                      (uintmax_t)coalesced);
 }
 
+void
+device_read_copied(struct device* d)
+{
+#ifndef BTSIXAD_NO_TIMING
+    if (read_stamp.processed) {
+        uint64_t t = timing_now();
+        timing_add(d, STAGE_COPY, read_stamp.processed, t);
+        timing_add(d, STAGE_TOTAL, read_stamp.received, t);
+        read_stamp.processed = 0;
+    }
+#endif
+}
+
+// Returns 0 if disconnected and -1 while stalled with nothing left to read.
 int
 device_read(struct device* d, int nonblock, unsigned char* buf, size_t* size)
 {
-    int r = 0;
+    if (!buf) { // buf=NULL used to poll
+        if (!report_ready(&d->input) && !report_stalled(&d->input))
+            *size = 0;
+        return 1;
+    }
+    size_t len = *size;
+    struct report_stamp stamp;
+    while (!report_get(&d->input, buf, size, &stamp)) {
+        if (report_stalled(&d->input))
+            return -1;
+        if (nonblock) {
+            *size = 0;
+            return 1;
+        }
+        if (report_closed(&d->input) || vuhid_cancelled())
+            return 0;
+        report_wait(&d->input, vuhid_cancelled);
+    }
+#ifndef BTSIXAD_NO_TIMING
+    read_stamp.received = stamp.received;
+    read_stamp.processed = timing_now();
+    timing_add(d, STAGE_WAKEUP, stamp.processed, read_stamp.processed);
+#endif
+    // Add any other queued reports that surely fit.
+    for (;;) {
+        size_t more = len - *size;
+        if (more < d->descr->input_size ||
+                !report_get(&d->input, buf + *size, &more, NULL))
+            break;
+        *size += more;
+    }
+    return 1;
+}
+
+void
+device_set_queue(struct device* d, int depth)
+{
+    report_set_depth(&d->input, depth);
+}
+
+void
+device_set_cache(struct device* d, int cache)
+{
+    // Reports weren't kept while caching was off.
     wp(pthread_mutex_lock(&d->mutex));
-    while (!d->intr_report.size && !nonblock) {
-        if (d->state == -1 || vuhid_cancelled())
-            goto unlock_done;
-        timed_wait(d);
-    }
-    if (*size > d->intr_report.size)
-        *size = d->intr_report.size;
-    if (buf) { // buf=NULL used to poll
-        memcpy(buf, d->intr_report.data, *size);
-        d->intr_report.size = 0;
-    }
-    r = 1;
-unlock_done:
+    if (cache && !atomic_load(&d->cache))
+        d->recent_size = 0;
+    atomic_store(&d->cache, cache);
     wp(pthread_mutex_unlock(&d->mutex));
-    return r;
 }
 
-int
-device_write(struct device* d, unsigned char* data, size_t size)
+void
+device_set_threshold(struct device* d, int threshold)
 {
-    return send_message(d, 0, 0xa2, data, size);
+    atomic_store(&d->threshold, threshold);
 }
 
-int
-device_get_report(struct device* d, int kind, unsigned char* data, size_t* size)
+void
+device_set_rate(struct device* d, int rate)
 {
-    int r = -1;
     wp(pthread_mutex_lock(&d->mutex));
-    while (d->ctrl_query.type) {
-        if (d->state == -1 || vuhid_cancelled())
-            goto unlock_done;
-        timed_wait(d);
-    }
-    d->ctrl_query.type = 1;
-    d->ctrl_query.kind = kind;
-    d->ctrl_query.result = -1;
-    d->ctrl_query.cancelled = 0;
-    d->ctrl_query.data = data;
-    d->ctrl_query.size = *size;
-    int id = d->descr->id && *size ? data[0] : 0; // before data is clobbered
+    atomic_store(&d->rate, rate);
+    if (!rate)
+        d->throttle.held_size = 0;
     wp(pthread_mutex_unlock(&d->mutex));
+}
 
-    // Sixaxis seems to require report size in the message
-    assert(*size <= DEVICE_MAX_REPORT_SIZE && DEVICE_MAX_REPORT_SIZE <= 0xffff);
-    unsigned char buf[] = { id, *size & 0xff, *size >> 8 };
+void
+device_stats(struct device* d, struct btsixa_stats* stats)
+{
+    stats->suppressed = atomic_load(&d->suppressed);
+    stats->throttled = atomic_load(&d->throttled);
+    stats->reports = report_count(&d->input) + stats->suppressed +
+                     stats->throttled;
+    stats->overruns = report_overruns(&d->input);
+    stats->output_sent = atomic_load(&d->output.sent);
+    stats->output_coalesced = atomic_load(&d->output.coalesced);
+}
 
-    assert(kind >= 1 && kind <= 3);
-    int sent = send_message(d, 1, 0x48 + kind,
-                            buf+!d->descr->id, sizeof buf-!d->descr->id);
 
+// Programs may write the output report every frame to keep rumbling, which
+// takes time on the air from input reports. With output_rate, writes are
+// merged into a shadow of the whole report, which is sent unless unchanged,
+// but no more than output_rate times a second. Sooner changes wait for
+// device_run to send the latest state. Without it, writes are sent as they
+// are, though not during a send of the shadow, and still kept in the shadow
+// for effects.
+
+// Called with mutex held, which is released while sending.
+static void
+output_send(struct device* d)
+{
+    unsigned char buf[DEVICE_OUTPUT_SIZE];
+    size_t size = d->descr->output_size;
+    memcpy(buf, d->output.shadow, size);
+    d->output.pending = 0;
+    d->output.sending = 1;
+    atomic_fetch_add_explicit(&d->output.sent, 1, memory_order_relaxed);
+    uint64_t now = clock_now();
+    d->output.next = output_rate ? now + 1000000000 / output_rate : now;
+    wp(pthread_mutex_unlock(&d->mutex));
+    send_message(d, 0, 0xa2, buf, size);
     wp(pthread_mutex_lock(&d->mutex));
-    while (sent && d->ctrl_query.result == -1) {
-        if (d->state == -1 || vuhid_cancelled()) {
-            // ctrl_run is responsible for discarding the result
-            d->ctrl_query.cancelled = 1;
-            goto unlock_done;
-        }
-        timed_wait(d);
-    }
-    *size = d->ctrl_query.size;
-    r = d->ctrl_query.result;
-    d->ctrl_query.type = 0;
+    d->output.sending = 0;
     wp(pthread_cond_broadcast(&d->cond));
-unlock_done:
+}
+
+// Whether it was for the shadow. Called with mutex held.
+static int
+output_merge(struct device* d, unsigned char* data, size_t size, int* changed)
+{
+    size_t n = d->descr->output_size;
+    if (!n || !size || data[0] != d->descr->id)
+        return 0;
+    if (size > n)
+        size = n;
+    *changed = memcmp(d->output.shadow, data, size) != 0;
+    memcpy(d->output.shadow, data, size);
+    return 1;
+}
+
+// Send the changed shadow now if allowed, otherwise have device_run send it.
+// Called with mutex held, which may be released.
+static void
+output_schedule(struct device* d)
+{
+    if (d->output.sending || clock_now() < d->output.next) {
+        d->output.pending = 1;
+        wp(pthread_cond_broadcast(&d->cond));
+    } else
+        output_send(d);
+}
+
+int
+device_write(struct device* d, unsigned char* data, size_t size)
+{
+    if (d->driver->synthetic)
+        return 0;
+    int changed;
+    wp(pthread_mutex_lock(&d->mutex));
+    int merged = output_merge(d, data, size, &changed);
+    if (!merged || !output_rate) {
+        // after any shadow being sent, which would overtake it otherwise
+        while (d->output.sending && d->state != -1)
+            wp(pthread_cond_wait(&d->cond, &d->mutex));
+        if (merged)
+            atomic_fetch_add_explicit(&d->output.sent, 1,
+                                      memory_order_relaxed);
+        d->output.sending = 1;
+        wp(pthread_mutex_unlock(&d->mutex));
+        int r = send_message(d, 0, 0xa2, data, size);
+        wp(pthread_mutex_lock(&d->mutex));
+        d->output.sending = 0;
+        wp(pthread_cond_broadcast(&d->cond));
+        wp(pthread_mutex_unlock(&d->mutex));
+        return r;
+    }
+    if (!changed || d->output.pending)
+        atomic_fetch_add_explicit(&d->output.coalesced, 1,
+                                  memory_order_relaxed);
+    else
+        output_schedule(d);
+    int r = d->state != -1;
     wp(pthread_mutex_unlock(&d->mutex));
     return r;
 }
 
+// Rumble effects are played by device_run changing the motors in the shadow,
+// which is sent like a write.
+
 int
-device_set_report(struct device* d, int kind, unsigned char* data, size_t size)
+device_play_effect(struct device* d, const struct btsixa_effect* e)
 {
-    int r = -1;
+    if (!d->driver->rumble || e->n_steps > BTSIXA_EFFECT_STEPS)
+        return 0;
     wp(pthread_mutex_lock(&d->mutex));
-    while (d->ctrl_query.type) {
-        if (d->state == -1 || vuhid_cancelled())
-            goto unlock_done;
-        timed_wait(d);
+    memcpy(d->effect.steps, e->steps, e->n_steps * sizeof *e->steps);
+    d->effect.n = e->n_steps;
+    d->effect.step = 0;
+    d->effect.due = clock_now();
+    wp(pthread_cond_broadcast(&d->cond));
+    wp(pthread_mutex_unlock(&d->mutex));
+    return 1;
+}
+
+// Called with mutex held when the next step is due, which may be released.
+static void
+effect_step(struct device* d)
+{
+    int weak = 0, strong = 0;
+    if (d->effect.step < d->effect.n) {
+        const struct btsixa_effect_step* s = &d->effect.steps[d->effect.step];
+        weak = s->weak;
+        strong = s->strong;
+        d->effect.step++;
+        d->effect.due += (uint64_t)s->ms * 1000000;
+    } else
+        d->effect.step = -1;
+    unsigned char last[DEVICE_OUTPUT_SIZE];
+    size_t size = d->descr->output_size;
+    memcpy(last, d->output.shadow, size);
+    d->driver->rumble(d->output.shadow, weak, strong);
+    if (memcmp(last, d->output.shadow, size) && !d->output.pending)
+        output_schedule(d);
+}
+
+// Output reports sent as SET_REPORT, such as for the LEDs, also change what
+// the device has.
+static void
+output_set(struct device* d, int kind, unsigned char* data, size_t size)
+{
+    if (kind == UHID_OUTPUT_REPORT) {
+        int changed;
+        wp(pthread_mutex_lock(&d->mutex));
+        output_merge(d, data, size, &changed);
+        wp(pthread_mutex_unlock(&d->mutex));
     }
-    d->ctrl_query.type = 2;
-    d->ctrl_query.result = -1;
+}
+
+// Control requests are pipelined as far as the transport allows: each takes a
+// place in a queue and is sent right away, and responses are matched to the
+// queue in order. Requests must be sent in the order of their places, so they
+// take a ticket.
+
+static int
+ctrl_request(struct device* d, int type, struct query* q,
+             unsigned char message, unsigned char* data, size_t size)
+{
+    wp(pthread_mutex_lock(&d->mutex));
+    while (d->queries.count == d->transport->queries) {
+        if (d->state == -1 || q && vuhid_cancelled()) {
+            wp(pthread_mutex_unlock(&d->mutex));
+            return 0;
+        }
+        wp(pthread_cond_wait(&d->cond, &d->mutex));
+    }
+    int i = (d->queries.first + d->queries.count++) % DEVICE_MAX_QUERIES;
+    d->queries.queue[i].type = type;
+    d->queries.queue[i].q = q;
+    unsigned ticket = d->queries.tickets++;
+    while (d->queries.sent != ticket)
+        wp(pthread_cond_wait(&d->cond, &d->mutex));
     wp(pthread_mutex_unlock(&d->mutex));
 
-    assert(kind >= 1 && kind <= 3);
-    int sent = send_message(d, 1, 0x50 + kind, data, size);
+    int sent = send_message(d, 1, message, data, size);
+
+    wp(pthread_mutex_lock(&d->mutex));
+    d->queries.sent++;
+    if (!sent && d->queries.queue[i].q == q)
+        d->queries.queue[i].q = NULL;
+    wp(pthread_cond_broadcast(&d->cond));
+    wp(pthread_mutex_unlock(&d->mutex));
+    return sent;
+}
 
+static int
+ctrl_result(struct device* d, struct query* q)
+{
     wp(pthread_mutex_lock(&d->mutex));
-    while (sent && d->ctrl_query.result == -1) {
+    while (q->result == -1) {
         if (d->state == -1 || vuhid_cancelled()) {
-            // ctrl_run is responsible for discarding the result
-            d->ctrl_query.cancelled = 1;
-            goto unlock_done;
+            // ctrl_message is responsible for discarding the result
+            for (int i = 0; i < d->queries.count; i++) {
+                int j = (d->queries.first + i) % DEVICE_MAX_QUERIES;
+                if (d->queries.queue[j].q == q)
+                    d->queries.queue[j].q = NULL;
+            }
+            break;
         }
         wp(pthread_cond_wait(&d->cond, &d->mutex));
     }
-    r = d->ctrl_query.result;
-    d->ctrl_query.type = 0;
-    wp(pthread_cond_broadcast(&d->cond));
-unlock_done:
     wp(pthread_mutex_unlock(&d->mutex));
+    return q->result;
+}
+
+// Called with mutex held when a response arrives.
+static struct query*
+ctrl_response(struct device* d)
+{
+    struct query* q = d->queries.queue[d->queries.first].q;
+    d->queries.first = (d->queries.first + 1) % DEVICE_MAX_QUERIES;
+    d->queries.count--;
+    wp(pthread_cond_broadcast(&d->cond));
+    return q;
+}
+
+// The latest input report is as good as asking the device, but only if it
+// was sent while the device is open, i.e. operational. That is the last one
+// received, not delivered, which may be held back by the rate or threshold.
+static int
+cached_report(struct device* d, int kind, int id,
+              unsigned char* data, size_t* size)
+{
+    if (!atomic_load(&d->cache))
+        return 0;
+    if (kind == UHID_INPUT_REPORT) {
+        wp(pthread_mutex_lock(&d->mutex));
+        size_t n = d->recent_size;
+        int r = n && (!d->descr->id || d->recent[0] == id);
+        if (r) {
+            if (n > *size)
+                n = *size;
+            memcpy(data, d->recent, n);
+            *size = n;
+        }
+        wp(pthread_mutex_unlock(&d->mutex));
+        return r;
+    }
+    if (kind == UHID_FEATURE_REPORT)
+        for (int i = 0; i < d->n_features; i++)
+            if (d->features[i].id == id && *size <= d->features[i].size) {
+                memcpy(data, d->features[i].data, *size);
+                return 1;
+            }
+    return 0;
+}
+
+static void
+cache_features(struct device* d)
+{
+    for (size_t i = 0; i < d->descr->n_static_features &&
+                       d->n_features < DEVICE_MAX_CACHED; i++) {
+        int id = d->descr->static_features[i];
+        unsigned char* data = d->features[d->n_features].data;
+        size_t size = DEVICE_CACHED_SIZE;
+        data[0] = id;
+        if (device_get_report(d, UHID_FEATURE_REPORT, data, &size) == 0) {
+            d->features[d->n_features].id = id;
+            d->features[d->n_features].size = size;
+            d->n_features++;
+        }
+    }
+}
+
+int
+device_get_report(struct device* d, int kind, unsigned char* data, size_t* size)
+{
+    struct query q = { kind, -1, data, *size };
+    int id = d->descr->id && *size ? data[0] : 0; // before data is clobbered
+    if (d->driver->synthetic) {
+        // Only our own input report exists.
+        if (kind != UHID_INPUT_REPORT || id != d->descr->id)
+            return 2; // ERR_INVALID_REPORT_ID
+        size_t n = *size;
+        if (!report_latest(&d->input, 0, data, &n))
+            return 1; // NOT_READY
+        *size = n;
+        return 0;
+    }
+    if (cached_report(d, kind, id, data, size))
+        return 0;
+
+    // Sixaxis seems to require report size in the message
+    assert(*size <= DEVICE_MAX_REPORT_SIZE && DEVICE_MAX_REPORT_SIZE <= 0xffff);
+    unsigned char buf[] = { id, *size & 0xff, *size >> 8 };
+
+    assert(kind >= 1 && kind <= 3);
+    if (!ctrl_request(d, 1, &q, 0x48 + kind,
+                      buf+!d->descr->id, sizeof buf-!d->descr->id))
+        return -1;
+    int r = ctrl_result(d, &q);
+    *size = q.size;
     return r;
 }
 
+int
+device_set_report(struct device* d, int kind, unsigned char* data, size_t size)
+{
+    struct query q = { kind, -1 };
+    assert(kind >= 1 && kind <= 3);
+    if (d->driver->synthetic)
+        return 2; // we have no output or feature reports
+    output_set(d, kind, data, size);
+    if (!ctrl_request(d, 2, &q, 0x50 + kind, data, size))
+        return -1;
+    return ctrl_result(d, &q);
+}
 
-static void*
-ctrl_run(void* d_void)
+int
+device_set_report_async(struct device* d, int kind,
+                        unsigned char* data, size_t size)
 {
-    struct device* d = d_void;
-    unsigned char* buf = wm(malloc(DEVICE_MAX_REPORT_SIZE));
-    for (;;) {
-        int unexpected = 0;
-        unsigned char message;
-        size_t size = DEVICE_MAX_REPORT_SIZE;
-        if (!recv_message(d, 1, &message, buf, &size))
-            break;
-        switch (message >> 4) {
-        case 0: // HANDSHAKE in response to GET_REPORT or SET_REPORT
-            wp(pthread_mutex_lock(&d->mutex));
-            if (d->ctrl_query.type && d->ctrl_query.result == -1) {
-                if (d->ctrl_query.cancelled)
-                    d->ctrl_query.cancelled = d->ctrl_query.type = 0;
-                else {
-                    d->ctrl_query.result = message & 0xf;
-                    d->ctrl_query.size = 0;
-                }
-                wp(pthread_cond_broadcast(&d->cond));
-            } else
-                unexpected = 1;
-            wp(pthread_mutex_unlock(&d->mutex));
-            break;
-        case 10: // DATA in response to GET_REPORT
-            wp(pthread_mutex_lock(&d->mutex));
-            if (d->ctrl_query.type == 1 && d->ctrl_query.result == -1) {
-                if (d->ctrl_query.cancelled)
-                    d->ctrl_query.cancelled = d->ctrl_query.type = 0;
-                else {
-                    if (d->sixaxis)
-                        sixaxis_fixup(d, d->ctrl_query.kind, buf, size);
-                    d->ctrl_query.result = 0;
-                    if (d->ctrl_query.size > size)
-                        d->ctrl_query.size = size;
-                    memcpy(d->ctrl_query.data, buf, d->ctrl_query.size);
-                }
-                wp(pthread_cond_broadcast(&d->cond));
-            } else
-                unexpected = 1;
-            wp(pthread_mutex_unlock(&d->mutex));
-            break;
-        case 1: // HID_CONTROL
-            switch (message & 0xf) {
-            case 5: // VIRTUAL_CABLE_UNPLUG
-                // TODO: should erase persistent configuration information
-                syslog(LOG_DEBUG, "virtual cable unplug by device");
-                device_disconnect(d);
-                break;
-            default:
-                ; // shall ignore other operations
+    assert(kind >= 1 && kind <= 3);
+    output_set(d, kind, data, size);
+    return ctrl_request(d, 2, NULL, 0x50 + kind, data, size);
+}
+
+
+static int
+ctrl_message(struct device* d, unsigned char message,
+             unsigned char* buf, size_t size)
+{
+    int unexpected = 0;
+    switch (message >> 4) {
+    case 0: // HANDSHAKE in response to GET_REPORT or SET_REPORT
+        wp(pthread_mutex_lock(&d->mutex));
+        if (d->queries.count) {
+            struct query* q = ctrl_response(d);
+            if (q) {
+                q->result = message & 0xf;
+                q->size = 0;
+            }
+        } else
+            unexpected = 1;
+        wp(pthread_mutex_unlock(&d->mutex));
+        break;
+    case 10: // DATA in response to GET_REPORT
+        wp(pthread_mutex_lock(&d->mutex));
+        if (d->queries.count && d->queries.queue[d->queries.first].type == 1) {
+            struct query* q = ctrl_response(d);
+            if (q) {
+                if (d->driver->response)
+                    d->driver->response(d, q->kind, buf, size);
+                q->result = 0;
+                if (q->size > size)
+                    q->size = size;
+                memcpy(q->data, buf, q->size);
             }
+        } else
+            unexpected = 1;
+        wp(pthread_mutex_unlock(&d->mutex));
+        break;
+    case 1: // HID_CONTROL
+        switch (message & 0xf) {
+        case 5: // VIRTUAL_CABLE_UNPLUG
+            logger_printf(LOG_DEBUG, "virtual cable unplug by device");
+            pnp_forget(&d->bdaddr);
+            device_disconnect(d);
             break;
         default:
-            // should not get other messages without requests
-            unexpected = 1;
+            ; // shall ignore other operations
         }
-        if (unexpected) {
-            syslog(LOG_DEBUG, "unexpected control message, disconnecting");
+        break;
+    default:
+        // should not get other messages without requests
+        unexpected = 1;
+    }
+    if (unexpected) {
+        logger_printf(LOG_DEBUG,
+                      "unexpected control message, disconnecting");
+        return 0;
+    }
+    return 1;
+}
+
+
+// Whether an input report should be delivered, compared to the last one
+// delivered. The masked comparison has no early exit so that the compiler
+// can vectorize it; reports are compared as a whole a hundred times a second.
+static int
+input_changed(struct device* d, int threshold,
+              const unsigned char* data, size_t size)
+{
+    const struct descr* descr = d->descr;
+    int changed = threshold < 0 || size != d->last_size ||
+                  size > descr->input_size;
+    if (!changed) {
+        unsigned char diff = 0;
+        for (size_t i = 0; i < size; i++)
+            diff |= (data[i] ^ d->last_input[i]) & descr->exact_mask[i];
+        changed = diff != 0;
+    }
+    for (size_t i = 0; !changed && i < descr->motion.count; i++) {
+        size_t k = descr->motion.offset + 2*i;
+        if (k+2 > size)
             break;
+        int now = data[k] << 8 | data[k+1];
+        int last = d->last_input[k] << 8 | d->last_input[k+1];
+        changed = abs(now - last) > threshold;
+    }
+    return changed;
+}
+
+// Keep the report being delivered to compare with, unless nothing will be.
+static void
+input_remember(struct device* d, int keep,
+               const unsigned char* data, size_t size)
+{
+    if (!keep || size > d->descr->input_size)
+        d->last_size = 0;
+    else {
+        memcpy(d->last_input, data, size);
+        d->last_size = size;
+    }
+}
+
+// Whether buttons changed since the last report delivered.
+static int
+input_pressed(struct device* d, const unsigned char* data, size_t size)
+{
+    const unsigned char* mask = d->descr->button_mask;
+    if (!mask || size != d->last_size)
+        return 1;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < size; i++)
+        diff |= (data[i] ^ d->last_input[i]) & mask[i];
+    return diff != 0;
+}
+
+static void
+input_deliver(struct device* d, const unsigned char* data, size_t size,
+              uint64_t received)
+{
+    // Reports received while the file is closed are discarded on open.
+    // Buffering only one report is really enough: some users like GLFW
+    // don't care about transitions, only the current state, and we don't
+    // want a situation where a slow user will only read stale reports
+    // from the back of the queue.
+    struct report_stamp stamp = { received, timing_now() };
+    report_put(&d->input, data, size, &stamp);
+    mux_notify(d);
+    timing_add(d, STAGE_PROCESS, received, stamp.processed);
+    timing_add(d, STAGE_PUBLISH, stamp.processed, timing_now());
+}
+
+// With a rate, a report that comes too soon is held, replacing any held
+// before, and device_run delivers it when it's time unless a later report is
+// delivered first. Only then is the mutex taken; device_set_rate takes it to
+// drop a held report when the rate is removed.
+static void
+input_throttle(struct device* d, unsigned char* data, size_t size,
+               uint64_t received)
+{
+    wp(pthread_mutex_lock(&d->mutex));
+    int rate = atomic_load(&d->rate);
+    int threshold = atomic_load_explicit(&d->threshold, memory_order_relaxed);
+    if (d->throttle.held_size)
+        atomic_fetch_add_explicit(&d->throttled, 1, memory_order_relaxed);
+    if (!input_changed(d, threshold, data, size)) {
+        // back to what was delivered
+        d->throttle.held_size = 0;
+        atomic_fetch_add_explicit(&d->suppressed, 1, memory_order_relaxed);
+    } else if (rate && clock_now() < d->throttle.next &&
+               size <= d->descr->input_size &&
+               !input_pressed(d, data, size)) {
+        if (!d->throttle.held_size)
+            wp(pthread_cond_broadcast(&d->cond));
+        memcpy(d->throttle.held, data, size);
+        d->throttle.held_size = size;
+        d->throttle.received = received;
+    } else {
+        d->throttle.held_size = 0;
+        d->throttle.next = rate ? clock_now() + 1000000000 / rate : 0;
+        input_remember(d, 1, data, size);
+        input_deliver(d, data, size, received);
+    }
+    wp(pthread_mutex_unlock(&d->mutex));
+}
+
+// Called with mutex held when the held report is due.
+static void
+input_flush(struct device* d)
+{
+    size_t size = d->throttle.held_size;
+    int rate = atomic_load(&d->rate);
+    d->throttle.held_size = 0;
+    d->throttle.next = rate ? clock_now() + 1000000000 / rate : 0;
+    input_remember(d, 1, d->throttle.held, size);
+    struct report_stamp stamp = { d->throttle.received, timing_now() };
+    report_put(&d->input, d->throttle.held, size, &stamp);
+    mux_notify(d);
+}
+
+// Kept for GET_REPORT only while caching, so the mutex isn't taken for
+// every report otherwise.
+static void
+input_recent(struct device* d, const unsigned char* data, size_t size)
+{
+    wp(pthread_mutex_lock(&d->mutex));
+    if (d->state != 1 || size > d->descr->input_size) // or closed meanwhile
+        d->recent_size = 0;
+    else {
+        memcpy(d->recent, data, size);
+        d->recent_size = size;
+    }
+    wp(pthread_mutex_unlock(&d->mutex));
+}
+
+static int
+intr_message(struct device* d, unsigned char message,
+             unsigned char* buf, size_t size, uint64_t received)
+{
+    if (message == 0xa1) {
+        if (stall_gap)
+            watchdog_feed(d, received);
+        if (!(size = d->driver->input(d, buf, size)))
+            return 1; // nothing we present
+        shm_publish(d, buf, size, received);
+        if (atomic_load_explicit(&d->cache, memory_order_relaxed))
+            input_recent(d, buf, size);
+        if (atomic_load_explicit(&d->rate, memory_order_relaxed)) {
+            input_throttle(d, buf, size, received);
+            return 1;
+        }
+        int threshold =
+            atomic_load_explicit(&d->threshold, memory_order_relaxed);
+        if (!input_changed(d, threshold, buf, size)) {
+            atomic_fetch_add_explicit(&d->suppressed, 1, memory_order_relaxed);
+            return 1;
+        }
+        input_remember(d, threshold >= 0, buf, size);
+        input_deliver(d, buf, size, received);
+    } else {
+        logger_printf(LOG_DEBUG,
+                      "unexpected interrupt message, disconnecting");
+        return 0;
+    }
+    return 1;
+}
+
+
+// If ready, a message is known to be waiting, so the time to read it is
+// worth recording.
+int
+device_process(struct device* d, int ctrl, int ready, unsigned char* buf)
+{
+    unsigned char message;
+    size_t size = DEVICE_MAX_REPORT_SIZE;
+    uint64_t start = ready && !ctrl ? timing_now() : 0;
+    if (recv_message(d, ctrl, &message, buf, &size)) {
+        if (ctrl) {
+            if (ctrl_message(d, message, buf, size))
+                return 1;
+        } else {
+            uint64_t received = timing_now();
+            if (start)
+                timing_add(d, STAGE_RECV, start, received);
+            if (intr_message(d, message, buf, size, received))
+                return 1;
         }
     }
-    free(buf);
     device_disconnect(d);
+    return 0;
+}
+
+void
+device_finished(struct device* d)
+{
+    wp(pthread_mutex_lock(&d->mutex));
+    d->channels--;
+    wp(pthread_cond_broadcast(&d->cond));
+    wp(pthread_mutex_unlock(&d->mutex));
+}
+
+static void*
+channel_run(struct device* d, int ctrl)
+{
+    unsigned char buf[DEVICE_MAX_REPORT_SIZE];
+    while (device_process(d, ctrl, 0, buf))
+        ;
+    device_finished(d);
     return NULL;
 }
 
+static void*
+ctrl_run(void* d_void)
+{
+    return channel_run(d_void, 1);
+}
 
 static void*
 intr_run(void* d_void)
+{
+    return channel_run(d_void, 0);
+}
+
+
+// Called on the timer thread when the first deadline of device_run passes.
+static void
+device_alarm(void* d_void)
 {
     struct device* d = d_void;
-    unsigned char* buf = wm(malloc(DEVICE_MAX_REPORT_SIZE));
-    for (;;) {
-        unsigned char message;
-        size_t size = DEVICE_MAX_REPORT_SIZE;
-        if (!recv_message(d, 0, &message, buf, &size))
-            break;
-        if (message == 0xa1) {
-            if (d->sixaxis)
-                sixaxis_fixup(d, UHID_INPUT_REPORT, buf, size);
-            wp(pthread_mutex_lock(&d->mutex));
-            if (d->state == 1) {
-                // Only add to queue if file is open.
-                // Buffering only one report is really enough: some users like
-                // GLFW don't care about transitions, only the current state,
-                // and we don't want a situation where a slow user will only
-                // read stale reports from the back of the queue.
-                memcpy(d->intr_report.data, buf, size);
-                d->intr_report.size = size;
-                wp(pthread_cond_signal(&d->cond));
-            }
-            wp(pthread_mutex_unlock(&d->mutex));
-        } else {
-            syslog(LOG_DEBUG, "unexpected interrupt message, disconnecting");
-            break;
-        }
+    wp(pthread_mutex_lock(&d->mutex));
+    wp(pthread_cond_broadcast(&d->cond));
+    wp(pthread_mutex_unlock(&d->mutex));
+}
+
+void
+device_start(struct device* d)
+{
+    assert(d->ctrl >= 0 && d->intr >= 0 && d->driver);
+
+    if (!d->transport)
+        d->transport = &bluetooth_transport;
+    d->descr = d->driver->descr(d);
+    d->leds = -1;
+    d->leds_setting = 0;
+    report_init(&d->input, d->descr->input_size);
+    d->last_input = wm(malloc(d->descr->input_size));
+    d->last_size = 0;
+    atomic_init(&d->threshold, -1);
+    atomic_init(&d->suppressed, 0);
+    atomic_init(&d->rate, 0);
+    atomic_init(&d->throttled, 0);
+    d->throttle.held = wm(malloc(d->descr->input_size));
+    d->throttle.held_size = 0;
+    atomic_init(&d->cache, 0);
+    d->recent = wm(malloc(d->descr->input_size));
+    d->recent_size = 0;
+    assert(d->descr->output_size <= DEVICE_OUTPUT_SIZE);
+    memset(d->output.shadow, 0, sizeof d->output.shadow);
+    d->output.shadow[0] = d->descr->id;
+    d->output.pending = d->output.sending = 0;
+    d->output.next = 0;
+    atomic_init(&d->output.sent, 0);
+    atomic_init(&d->output.coalesced, 0);
+    d->effect.step = -1;
+    timer_init(&d->timer, device_alarm, d);
+    timer_init(&d->watchdog, watchdog_fire, d);
+    atomic_init(&d->watching, 0);
+    atomic_init(&d->stalled, 0);
+    atomic_init(&d->arrived, 0);
+
+    wp(pthread_mutex_init(&d->mutex, NULL));
+    wp(pthread_cond_init(&d->cond, NULL));
+
+    // Either the shared event loop or a pair of threads per device.
+    d->channels = 2;
+    if (!loop_add(d)) {
+        pthread_t ctrl_thread, intr_thread;
+        wp(pthread_create(&ctrl_thread, NULL, ctrl_run, d));
+        wp(pthread_detach(ctrl_thread));
+        wp(pthread_create(&intr_thread, NULL, intr_run, d));
+        wp(pthread_detach(intr_thread));
     }
-    free(buf);
-    device_disconnect(d);
-    return NULL;
 }
 
+void
+device_stop(struct device* d)
+{
+    wp(pthread_mutex_lock(&d->mutex));
+    while (d->channels)
+        wp(pthread_cond_wait(&d->cond, &d->mutex));
+    wp(pthread_mutex_unlock(&d->mutex));
+
+    timer_drain(&d->timer);
+    timer_drain(&d->watchdog);
+    wp(pthread_cond_destroy(&d->cond));
+    wp(pthread_mutex_destroy(&d->mutex));
+
+    report_destroy(&d->input);
+    free(d->last_input);
+    free(d->throttle.held);
+    free(d->recent);
+    if (d->driver->stop)
+        d->driver->stop(d);
+}
 
 void
 device_run(struct device* d)
 {
     assert(d->ctrl >= 0 && d->intr >= 0);
 
-    query_sdp(d);
-    if (!d->sixaxis)
+    if (!d->transport)
+        d->transport = &bluetooth_transport;
+    d->transport->identify(d);
+    if (!d->driver)
         return;
-    d->descr = &sixaxis_descr;
-    d->intr_report.data = wm(malloc(DEVICE_MAX_REPORT_SIZE));
-
-    pthread_condattr_t condattr;
-    wp(pthread_mutex_init(&d->mutex, NULL));
-    wp(pthread_condattr_init(&condattr));
-    wp(pthread_condattr_setclock(&condattr, timed_clock));
-    wp(pthread_cond_init(&d->cond, &condattr));
-    wp(pthread_condattr_destroy(&condattr));
-
-    pthread_t ctrl_thread, intr_thread;
-    wp(pthread_create(&ctrl_thread, NULL, ctrl_run, d));
-    wp(pthread_create(&intr_thread, NULL, intr_run, d));
+    device_start(d);
 
     vuhid_allocate_unit(d);
     // Send our control messages before user can access device.
     reflect_state(d, 0);
+    cache_features(d);
     vuhid_open(d);
 
     wp(pthread_mutex_lock(&d->mutex));
-    struct timespec until;
+    uint64_t until = 0;
     int timed_out = 0;
     while (d->state != -1 && !timed_out) {
-        if (timeout && !d->timeout_running && d->state == 0) {
+        if (timeout && !d->timeout_running && d->state == 0 &&
+                !atomic_load(&d->watched)) {
             d->timeout_running = 1;
-            we(clock_gettime(timed_clock, &until));
-            until.tv_sec += timeout;
+            until = clock_now() + (uint64_t)timeout * 1000000000;
         }
-        if (d->timeout_running) {
-            int r = pthread_cond_timedwait(&d->cond, &d->mutex, &until);
-            if (r == ETIMEDOUT)
-                timed_out = 1;
-            else
-                wp(r);
-        } else
-            wp(pthread_cond_wait(&d->cond, &d->mutex));
+        // Have the timer thread wake us up for whichever is first: the
+        // timeout, the next step of an effect, a delayed output or a held
+        // input report.
+        uint64_t wake = d->timeout_running ? until : 0;
+        if (d->throttle.held_size) {
+            if (clock_now() >= d->throttle.next) {
+                input_flush(d);
+                continue;
+            }
+            if (!wake || d->throttle.next < wake)
+                wake = d->throttle.next;
+        }
+        if (d->effect.step >= 0) {
+            if (clock_now() >= d->effect.due) {
+                effect_step(d);
+                continue;
+            }
+            if (!wake || d->effect.due < wake)
+                wake = d->effect.due;
+        }
+        if (d->output.pending && !d->output.sending) {
+            if (clock_now() >= d->output.next) {
+                output_send(d);
+                continue;
+            }
+            if (!wake || d->output.next < wake)
+                wake = d->output.next;
+        }
+        if (wake)
+            timer_set(&d->timer, wake);
+        else
+            timer_unset(&d->timer);
+        wp(pthread_cond_wait(&d->cond, &d->mutex));
+        timed_out = d->timeout_running && clock_now() >= until;
     }
     wp(pthread_mutex_unlock(&d->mutex));
 
     vuhid_close(d);
+    device_print_timing(d, LOG_DEBUG);
 
-    if (timed_out)
-        if (d->sixaxis)
-            sixaxis_operational(d, -1);
-
-    wp(pthread_join(intr_thread, NULL));
-    wp(pthread_join(ctrl_thread, NULL));
-
-    wp(pthread_cond_destroy(&d->cond));
-    wp(pthread_mutex_destroy(&d->mutex));
+    // A driver's hook has the device drop the link, otherwise we do.
+    if (timed_out && d->driver->timeout)
+        d->driver->timeout(d);
+    else if (timed_out)
+        device_disconnect(d);
 
-    free(d->intr_report.data);
+    device_stop(d);
 }
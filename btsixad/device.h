@@ -1,61 +1,220 @@
 #ifndef BTSIXAD_DEVICE_H
 #define BTSIXAD_DEVICE_H
 
+#include "btsixa.h"
+#include "histogram.h"
+#include "pnp.h"
+#include "report.h"
+#include "timer.h"
+
 #define L2CAP_SOCKET_CHECKED
 #include <bluetooth.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
 
 // Protocol limit is 0xffff
 #define DEVICE_MAX_REPORT_SIZE 1024
 
+// Control requests sent without waiting for earlier responses
+#define DEVICE_MAX_QUERIES 8
+
+// Feature reports that don't change during a connection
+#define DEVICE_MAX_CACHED 4
+#define DEVICE_CACHED_SIZE 64
+
+// Output report kept to merge writes into
+#define DEVICE_OUTPUT_SIZE 64
+
 struct descr {
     struct {
         unsigned char* data;
         size_t size;
     } report;
     int id;// first or 0 for ioctl - a flag for whether to include IDs
+    size_t input_size; // largest input report, including ID
+    const unsigned char* static_features; // IDs of reports to cache
+    size_t n_static_features;
+    // for change detection, bytes of the input report that must match
+    // exactly and big-endian 16-bit motion sensors that are noisy
+    const unsigned char* exact_mask; // input_size bytes
+    struct {
+        size_t offset;
+        size_t count;
+    } motion;
+    // bytes of the output report with the first ID that writes are merged
+    // into, or 0 to pass writes on as they are
+    size_t output_size;
+    // bytes of the input report with buttons and hats, changes of which are
+    // delivered regardless of the rate
+    const unsigned char* button_mask; // input_size bytes
+};
+
+struct device;
+struct hid_plan;
+
+// What differs between models, chosen once when the device is identified, so
+// that reports go through one call each without checking the model.
+struct driver {
+    const char* model;
+    struct descr* (*descr)(struct device* d);
+    // Input report in place; returns the size to deliver, or 0 to drop it.
+    size_t (*input)(struct device* d, unsigned char* data, size_t size);
+    // Report returned by GET_REPORT, in place. Optional.
+    void (*response)(struct device* d, int kind,
+                     unsigned char* data, size_t size);
+    // Optional hooks, called with the device usable or in use (also when
+    // watched) or not, and to have an idle device disconnect, which is
+    // otherwise done by closing the channels.
+    void (*leds)(struct device* d, int opened);
+    void (*open)(struct device* d);
+    void (*close)(struct device* d);
+    void (*timeout)(struct device* d);
+    // Motors set in the output report, which has descr->output_size bytes.
+    // Optional, for devices that rumble.
+    void (*rumble)(unsigned char* report, int weak, int strong);
+    void (*stop)(struct device* d); // free what the driver allocated
+    int synthetic; // only our input report exists, requests aren't passed on
+    int streams; // sends input reports continuously while operational
+};
+
+// Stages of an input report on its way from the socket to a reader
+enum {
+    STAGE_RECV,    // reading the message, only in the event loop
+    STAGE_PROCESS, // fixup and change detection
+    STAGE_PUBLISH, // putting the report, including waking readers
+    STAGE_WAKEUP,  // from putting the report to a reader getting it
+    STAGE_COPY,    // copying the report out to the reader
+    STAGE_TOTAL,   // from reading the message to the copy being done
+    STAGES
+};
+
+// How the gamepad is reached: SDP and L2CAP sockets by default, but the
+// device layer can be driven by a fake gamepad over any sequenced packet
+// sockets.
+struct transport {
+    void (*identify)(struct device* d); // sets driver and model
+    ssize_t (*send)(int fd, const struct iovec* iov, int iovcnt);
+    ssize_t (*recv)(int fd, const struct iovec* iov, int iovcnt);
+    int queries; // control transactions in flight, DEVICE_MAX_QUERIES at most
+};
+
+extern const struct transport bluetooth_transport;
+
+struct query {
+    int kind;
+    int result; // -1 initially
+    unsigned char* data;
+    size_t size;
 };
 
 struct device {
     // initialized by server:
     bdaddr_t bdaddr;
     int ctrl, intr;
+    const struct transport* transport; // NULL for bluetooth_transport
     // private, zero-initialized:
-    int sixaxis;
+    const struct driver* driver; // NULL if not a device we can use
+    struct hid_plan* hid; // for hid_driver
     const char* model;
     struct descr* descr;
     struct cuse_dev* dev;
+    LIST_ENTRY(device) vuhid_next;
     int unit;
     int state; // 0 - closed, 1 - open, -1 - disconnected
+    atomic_int watched; // read through btsixamux, which counts as open
+    LIST_ENTRY(device) mux_next;
+    TAILQ_ENTRY(device) mux_pending;
+    int mux_attached, mux_queued;
+    uint64_t mux_seen; // last report delivered through btsixamux
     int timeout_running;
-    int d_printed;
+    struct timer timer; // wakes up device_run for the first deadline
+    atomic_int d_printed;
+    int channels; // ctrl and intr still being processed
+    struct report_buf input;
+    // LED states, with mutex held: the last one set, -1 initially, and the
+    // newest, which whoever is setting the LEDs sets next
+    int leds, leds_wanted, leds_setting;
+    atomic_int cache; // answer GET_REPORT from cached reports while open
+    unsigned char* recent; // last input report received while caching
+    size_t recent_size; // 0 if none
     struct {
-        unsigned char* data;
+        int id;
         size_t size;
-    } intr_report;
+        unsigned char data[DEVICE_CACHED_SIZE];
+    } features[DEVICE_MAX_CACHED];
+    int n_features;
+    atomic_int threshold; // for change detection, -1 for off
+    unsigned char* last_input; // last input report delivered
+    size_t last_size; // 0 to deliver the next one unconditionally
+    atomic_uint_fast64_t suppressed;
+    atomic_int rate; // of delivering input reports, 0 for all
     struct {
-        int type; // 1 - GET_REPORT, 2 - SET_REPORT
-        int kind;
-        int result; // -1 initially
-        int cancelled;
-        unsigned char* data;
-        size_t size;
-    } ctrl_query;
+        uint64_t next; // when the next report may be delivered
+        unsigned char* held; // latest report not delivered yet
+        size_t held_size; // 0 if none
+        uint64_t received; // of the held report
+    } throttle;
+    atomic_uint_fast64_t throttled;
+    struct timer watchdog; // for stalls while open, with stall_gap
+    atomic_int watching, stalled;
+    atomic_uint_fast64_t arrived; // when the last input report did
+    struct {
+        unsigned char shadow[DEVICE_OUTPUT_SIZE]; // as sent or to be sent
+        int pending; // shadow changed since sent
+        int sending; // only one at a time so they don't overtake
+        uint64_t next; // when sending is allowed again
+        atomic_uint_fast64_t sent, coalesced;
+    } output;
+    struct {
+        struct btsixa_effect_step steps[BTSIXA_EFFECT_STEPS];
+        int n, step; // step to play next, -1 when stopped
+        uint64_t due; // when the next step or stop is
+    } effect;
+#ifndef BTSIXAD_NO_TIMING
+    struct histogram stages[STAGES];
+#endif
+    struct {
+        struct {
+            int type; // 1 - GET_REPORT, 2 - SET_REPORT
+            struct query* q; // NULL if nobody waits for the result
+        } queue[DEVICE_MAX_QUERIES];
+        int first, count; // queries sent or being sent, oldest first
+        unsigned tickets, sent; // for sending in queue order
+    } queries;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
 };
 
+void device_identify(struct device* d, const struct pnp_info* info);
 void device_run(struct device* d);
+void device_start(struct device* d);
+void device_stop(struct device* d);
 void device_disconnect(struct device* d);
+void device_wakeup(struct device* d);
+int device_process(struct device* d, int ctrl, int ready, unsigned char* buf);
+void device_finished(struct device* d);
 
 int device_open(struct device* d);
 void device_close(struct device* d);
+void device_watch(struct device* d, int watch);
 int device_read(struct device* d, int nonblock,
                 unsigned char* data, size_t* size);
+void device_read_copied(struct device* d);
+void device_print_timing(struct device* d, int priority);
+void device_set_queue(struct device* d, int depth);
+void device_set_cache(struct device* d, int cache);
+void device_set_threshold(struct device* d, int threshold);
+void device_set_rate(struct device* d, int rate);
+int device_play_effect(struct device* d, const struct btsixa_effect* e);
+void device_stats(struct device* d, struct btsixa_stats* stats);
+void device_status(struct device* d, struct btsixa_status* status);
 int device_write(struct device* d,
                  unsigned char* data, size_t size);
 int device_get_report(struct device* d, int kind,
                       unsigned char* data, size_t* size);
 int device_set_report(struct device* d, int kind,
                       unsigned char* data, size_t size);
+int device_set_report_async(struct device* d, int kind,
+                            unsigned char* data, size_t size);
 
 #endif
@@ -0,0 +1,575 @@
+#include "hid.h"
+
+#include "wrap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// The descriptor comes over the air from an unauthenticated device, so every
+// item is bounds-checked and anything beyond these limits is rejected or
+// ignored. Only variable, non-constant input items in a joystick, gamepad or
+// multi-axis controller application collection are used.
+
+#define HID_MAX_DESCR 1024 // bytes
+#define HID_MAX_DEPTH 8 // nested collections
+#define HID_MAX_PUSH 4 // global item states pushed
+#define HID_MAX_USAGES 32 // local usages per main item
+#define HID_MAX_REPORTS 8 // input report IDs
+#define HID_MAX_BUTTONS 32
+#define HID_MAX_AXES 8
+#define HID_MAX_FIELDS (HID_MAX_BUTTONS + 1 + HID_MAX_AXES)
+
+// Our report: ID 1, buttons, then a hat switch and 16-bit axes if any.
+#define HID_STATE_SIZE (1 + HID_MAX_BUTTONS/8 + 1 + 2*HID_MAX_AXES)
+#define HID_DESCR_SIZE 256
+
+enum { FIELD_BUTTON, FIELD_HAT, FIELD_AXIS };
+
+// A value copied from an input report of the device to ours.
+struct field {
+    int report; // index, for grouping
+    uint16_t byte; // of the device's report, after the ID, where it starts
+    uint8_t nbytes, shift; // bytes it spans and bits before it in the first
+    uint8_t bits;
+    uint8_t count; // of buttons, which take a bit each if bits == count
+    uint8_t sign; // whether to sign-extend
+    uint8_t kind;
+    uint8_t scale; // low bits of an axis dropped to fit in 16 bits
+    uint16_t dst; // button number, or byte of the hat or axis in our report
+    uint16_t usage; // of an axis
+    int32_t min, max; // logical range, after scaling for an axis
+};
+
+struct plan_report {
+    int id; // 0 if the device doesn't use IDs
+    size_t bits; // of all items, including constant ones
+    size_t size; // bytes up to the last field, excluding the ID
+    int first, count; // fields
+};
+
+struct hid_plan {
+    struct descr descr;
+    int ids;
+    struct plan_report reports[HID_MAX_REPORTS];
+    int n_reports;
+    struct field fields[HID_MAX_FIELDS];
+    int n_fields;
+    int buttons, hat, axes;
+    unsigned char report_descr[HID_DESCR_SIZE];
+    unsigned char exact_mask[HID_STATE_SIZE];
+    unsigned char button_mask[HID_STATE_SIZE];
+    unsigned char state[HID_STATE_SIZE]; // our latest report
+    uint32_t pressed; // buttons of our latest report
+};
+
+struct globals {
+    uint32_t page;
+    int64_t min, max;
+    uint32_t size, count;
+    int id;
+};
+
+struct locals {
+    uint32_t usages[HID_MAX_USAGES];
+    int n_usages;
+    uint32_t usage_min, usage_max;
+    int has_min, has_max;
+};
+
+
+static struct plan_report*
+report_of(struct hid_plan* p, int id)
+{
+    for (int i = 0; i < p->n_reports; i++)
+        if (p->reports[i].id == id)
+            return &p->reports[i];
+    if (p->n_reports == HID_MAX_REPORTS)
+        return NULL;
+    struct plan_report* r = &p->reports[p->n_reports++];
+    r->id = id;
+    return r;
+}
+
+// Explicit usages come first and the range follows, and the last usage
+// applies to any remaining values.
+static void
+expand_range(struct locals* l)
+{
+    if (!l->has_min || !l->has_max || l->usage_max < l->usage_min)
+        return;
+    for (uint32_t u = l->usage_min;
+            u <= l->usage_max && l->n_usages < HID_MAX_USAGES; u++)
+        l->usages[l->n_usages++] = u;
+}
+
+static void
+add_field(struct hid_plan* p, struct plan_report* r, const struct globals* g,
+          uint32_t usage, size_t bit)
+{
+    struct field f = { r - p->reports };
+    f.byte = bit / 8;
+    f.shift = bit % 8;
+    f.bits = g->size;
+    f.nbytes = (f.shift + f.bits + 7) / 8;
+    f.sign = g->min < 0;
+    f.min = g->min;
+    f.max = g->max;
+    if (usage >> 16 == 0x09) { // Button
+        if (p->buttons == HID_MAX_BUTTONS)
+            return;
+        f.kind = FIELD_BUTTON;
+        f.count = 1;
+        f.dst = p->buttons++;
+    } else if (usage == 0x10039) { // Hat switch
+        if (p->hat || g->max - g->min != 7)
+            return; // only the first 8-way one
+        f.kind = FIELD_HAT;
+        p->hat = 1;
+    } else if (usage >= 0x10030 && usage <= 0x10038) { // X to Wheel
+        if (p->axes == HID_MAX_AXES || g->max <= g->min)
+            return;
+        f.kind = FIELD_AXIS;
+        f.usage = usage & 0xffff;
+        f.dst = p->axes++;
+        while (g->max >> f.scale > INT16_MAX ||
+               g->min >> f.scale < INT16_MIN)
+            f.scale++;
+        f.min = g->min >> f.scale;
+        f.max = g->max >> f.scale;
+    } else
+        return;
+    p->fields[p->n_fields++] = f;
+    if (r->size < f.byte + f.nbytes)
+        r->size = f.byte + f.nbytes;
+}
+
+// Returns 0 if the item is invalid.
+static int
+input_item(struct hid_plan* p, const struct globals* g, struct locals* l,
+           uint32_t flags, int gamepad)
+{
+    struct plan_report* r = report_of(p, g->id);
+    if (!r)
+        return 0;
+    uint64_t bits = (uint64_t)g->size * g->count;
+    if (r->bits + bits > 8 * (DEVICE_MAX_REPORT_SIZE - 1))
+        return 0;
+    // data, variable, and a size that fits
+    if (gamepad && (flags & 3) == 2 && g->size >= 1 && g->size <= 32) {
+        expand_range(l);
+        for (uint32_t i = 0; i < g->count && l->n_usages; i++)
+            add_field(p, r, g,
+                      l->usages[i < l->n_usages ? i : l->n_usages-1],
+                      r->bits + i*g->size);
+    }
+    r->bits += bits;
+    return 1;
+}
+
+static int
+compare_fields(const void* a, const void* b)
+{
+    const struct field* x = a, * y = b;
+    return x->report != y->report ? x->report - y->report : x->byte - y->byte;
+}
+
+static unsigned char*
+put_item(unsigned char* q, unsigned char prefix, int64_t value, int size)
+{
+    *q++ = prefix | (size == 4 ? 3 : size);
+    for (int i = 0; i < size; i++)
+        *q++ = value >> 8*i;
+    return q;
+}
+
+// Our report and descriptor, from the fields found.
+static void
+build(struct hid_plan* p)
+{
+    unsigned char* q = p->report_descr;
+    static const unsigned char head[] = {
+        0x05, 0x01, 0x09, 0x05, 0xa1, 0x01, 0x85, 0x01
+    };
+    memcpy(q, head, sizeof head);
+    q += sizeof head;
+    if (p->buttons) {
+        static const unsigned char button_items[] = {
+            0x05, 0x09, 0x19, 0x01, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01
+        };
+        memcpy(q, button_items, sizeof button_items);
+        q += sizeof button_items;
+        q = put_item(q, 0x28, p->buttons, 1); // Usage Maximum
+        q = put_item(q, 0x94, p->buttons, 1); // Report Count
+        q = put_item(q, 0x80, 0x02, 1); // Input (Data, Variable, Absolute)
+        if (p->buttons % 8) {
+            q = put_item(q, 0x94, 8 - p->buttons % 8, 1);
+            q = put_item(q, 0x80, 0x01, 1); // Input (Const) [padding]
+        }
+    }
+    q = put_item(q, 0x04, 0x01, 1); // Usage Page - Generic Desktop
+    if (p->hat) {
+        static const unsigned char hat_items[] = {
+            0x09, 0x39, 0x15, 0x00, 0x25, 0x07, 0x35, 0x00, 0x46, 0x3b, 0x01,
+            0x65, 0x14, 0x75, 0x04, 0x95, 0x01,
+            0x81, 0x42, // Input (Data, Variable, Absolute, Null State)
+            0x81, 0x01, // Input (Const) [padding]
+            0x64, 0x44 // Unit - None, Physical Maximum - 0
+        };
+        memcpy(q, hat_items, sizeof hat_items);
+        q += sizeof hat_items;
+    }
+    for (int a = 0; a < p->axes; a++)
+        for (int i = 0; i < p->n_fields; i++) {
+            struct field* f = &p->fields[i];
+            if (f->kind != FIELD_AXIS || f->dst != a)
+                continue;
+            q = put_item(q, 0x08, f->usage, 1); // Usage
+            q = put_item(q, 0x14, f->min, 4); // Logical Minimum
+            q = put_item(q, 0x24, f->max, 4); // Logical Maximum
+            q = put_item(q, 0x74, 16, 1); // Report Size
+            q = put_item(q, 0x94, 1, 1); // Report Count
+            q = put_item(q, 0x80, 0x02, 1); // Input (Data, Variable, Absolute)
+        }
+    *q++ = 0xc0; // End Collection
+
+    size_t hat = 1 + (p->buttons + 7) / 8, axes = hat + p->hat;
+    for (int i = 0; i < p->n_fields; i++) {
+        struct field* f = &p->fields[i];
+        if (f->kind == FIELD_HAT)
+            f->dst = hat;
+        else if (f->kind == FIELD_AXIS)
+            f->dst = axes + 2*f->dst;
+    }
+    size_t size = axes + 2*p->axes;
+    p->state[0] = 1;
+    if (p->hat)
+        p->state[hat] = 8; // null
+    memset(p->exact_mask, 0xff, size);
+    memset(p->button_mask, 0, size);
+    memset(p->button_mask + 1, 0xff, axes - 1);
+
+    p->descr = (struct descr){ p->report_descr, q - p->report_descr, 1, size,
+                               NULL, 0, p->exact_mask, { 0, 0 }, 0,
+                               p->button_mask };
+}
+
+struct hid_plan*
+hid_compile(const unsigned char* data, size_t size, const char** error)
+{
+    if (size > HID_MAX_DESCR) {
+        *error = "descriptor too long";
+        return NULL;
+    }
+    struct hid_plan* p = wm(calloc(1, sizeof *p));
+    struct globals g = { 0 }, stack[HID_MAX_PUSH];
+    struct locals l = { 0 };
+    int depth = 0, gamepad = 0, pushed = 0, ids = 0;
+    *error = NULL;
+    for (size_t i = 0; i < size && !*error;) {
+        unsigned char prefix = data[i];
+        if (prefix == 0xfe) { // long item, skipped
+            if (size - i < 3 || size - i - 3 < data[i+1]) {
+                *error = "truncated item";
+                break;
+            }
+            i += 3 + data[i+1];
+            continue;
+        }
+        size_t n = prefix & 3;
+        if (n == 3)
+            n = 4;
+        if (size - i - 1 < n) {
+            *error = "truncated item";
+            break;
+        }
+        uint32_t u = 0;
+        for (size_t k = 0; k < n; k++)
+            u |= (uint32_t)data[i+1+k] << 8*k;
+        int64_t s = n == 1 ? (int8_t)u : n == 2 ? (int16_t)u :
+                    n == 4 ? (int32_t)u : 0;
+        i += 1 + n;
+
+        int tag = prefix >> 4;
+        switch (prefix >> 2 & 3) {
+        case 0: // Main
+            switch (tag) {
+            case 0x8: // Input
+                if (!input_item(p, &g, &l, u, gamepad))
+                    *error = "too many reports or too long a report";
+                break;
+            case 0xa: // Collection
+                if (depth == HID_MAX_DEPTH) {
+                    *error = "collections nested too deeply";
+                    break;
+                }
+                depth++;
+                if (!gamepad && u == 1 /* Application */ && l.n_usages &&
+                        (l.usages[0] == 0x10004 || // Joystick
+                         l.usages[0] == 0x10005 || // Gamepad
+                         l.usages[0] == 0x10008)) // Multi-axis Controller
+                    gamepad = depth;
+                break;
+            case 0xc: // End Collection
+                if (!depth) {
+                    *error = "unbalanced collections";
+                    break;
+                }
+                if (gamepad == depth)
+                    gamepad = 0;
+                depth--;
+                break;
+            }
+            l = (struct locals){ 0 };
+            break;
+        case 1: // Global
+            switch (tag) {
+            case 0x0: g.page = u & 0xffff; break;
+            case 0x1: g.min = s; break;
+            case 0x2: g.max = s; break;
+            case 0x7: g.size = u; break;
+            case 0x9: g.count = u; break;
+            case 0x8: // Report ID
+                if (u < 1 || u > 255)
+                    *error = "invalid report ID";
+                g.id = u;
+                ids = 1;
+                break;
+            case 0xa: // Push
+                if (pushed == HID_MAX_PUSH)
+                    *error = "globals pushed too deeply";
+                else
+                    stack[pushed++] = g;
+                break;
+            case 0xb: // Pop
+                if (!pushed)
+                    *error = "globals popped without push";
+                else
+                    g = stack[--pushed];
+                break;
+            }
+            // A maximum that only fits unsigned, e.g. 0x25 0xff for 255.
+            if (tag == 0x2 && g.min >= 0 && g.max < g.min && n < 4)
+                g.max = u;
+            break;
+        case 2: // Local
+            switch (tag) {
+            case 0x0: // Usage
+                if (l.n_usages < HID_MAX_USAGES)
+                    l.usages[l.n_usages++] = n == 4 ? u : g.page << 16 | u;
+                break;
+            case 0x1:
+                l.usage_min = n == 4 ? u : g.page << 16 | u;
+                l.has_min = 1;
+                break;
+            case 0x2:
+                l.usage_max = n == 4 ? u : g.page << 16 | u;
+                l.has_max = 1;
+                break;
+            }
+            break;
+        default:
+            *error = "reserved item type";
+        }
+    }
+    if (!*error && depth)
+        *error = "unbalanced collections";
+    if (!*error && ids)
+        for (int i = 0; i < p->n_reports; i++)
+            if (!p->reports[i].id && p->reports[i].bits)
+                *error = "reports both with and without IDs";
+    if (!*error && !p->n_fields)
+        *error = "no gamepad buttons or axes";
+    if (*error) {
+        free(p);
+        return NULL;
+    }
+
+    p->ids = ids;
+    qsort(p->fields, p->n_fields, sizeof *p->fields, compare_fields);
+    // Single-bit buttons next to each other are copied at once.
+    int n = 0;
+    for (int i = 0; i < p->n_fields; i++) {
+        struct field* f = &p->fields[i], * run = n ? &p->fields[n-1] : NULL;
+        if (run && f->kind == FIELD_BUTTON && run->kind == FIELD_BUTTON &&
+                f->report == run->report && f->bits == 1 &&
+                run->bits == run->count &&
+                8*f->byte + f->shift == 8*run->byte + run->shift + run->bits &&
+                f->dst == run->dst + run->count) {
+            run->bits++;
+            run->count++;
+            run->nbytes = (run->shift + run->bits + 7) / 8;
+        } else
+            p->fields[n++] = *f;
+    }
+    p->n_fields = n;
+    for (int i = p->n_fields; i--;) {
+        struct plan_report* r = &p->reports[p->fields[i].report];
+        r->first = i;
+        r->count++;
+    }
+    build(p);
+    return p;
+}
+
+void
+hid_free(struct hid_plan* p)
+{
+    free(p);
+}
+
+struct descr*
+hid_descr(struct hid_plan* p)
+{
+    return &p->descr;
+}
+
+void
+hid_summary(struct hid_plan* p, int* buttons, int* hat, int* axes)
+{
+    *buttons = p->buttons;
+    *hat = p->hat;
+    *axes = p->axes;
+}
+
+// Replaces an input report of the device with ours, for which data must have
+// room. Returns its size, or 0 if the report has nothing for it.
+size_t
+hid_transform(struct hid_plan* p, unsigned char* data, size_t size)
+{
+    const unsigned char* in = data;
+    int id = 0;
+    if (p->ids) {
+        if (!size)
+            return 0;
+        id = *in++;
+        size--;
+    }
+    struct plan_report* r = NULL;
+    for (int i = 0; i < p->n_reports && !r; i++)
+        if (p->reports[i].id == id)
+            r = &p->reports[i];
+    if (!r || !r->count || size < r->size)
+        return 0;
+
+    for (struct field* f = &p->fields[r->first];
+            f < &p->fields[r->first + r->count]; f++) {
+        uint64_t v = 0;
+        for (int k = 0; k < f->nbytes; k++)
+            v |= (uint64_t)in[f->byte + k] << 8*k;
+        v = v >> f->shift & ((uint64_t)1 << f->bits) - 1;
+        int64_t x = v;
+        if (f->sign && v >> (f->bits - 1))
+            x -= (int64_t)1 << f->bits;
+        switch (f->kind) {
+        case FIELD_BUTTON: {
+            uint32_t mask = ((uint64_t)1 << f->count) - 1;
+            p->pressed = p->pressed & ~(mask << f->dst) |
+                         (f->bits == f->count ? v : v != 0) << f->dst;
+            break;
+        }
+        case FIELD_HAT:
+            x -= f->min;
+            p->state[f->dst] = x >= 0 && x <= 7 ? x : 8;
+            break;
+        case FIELD_AXIS:
+            x >>= f->scale;
+            if (x < f->min)
+                x = f->min;
+            else if (x > f->max)
+                x = f->max;
+            p->state[f->dst] = x;
+            p->state[f->dst+1] = x >> 8;
+            break;
+        }
+    }
+    for (int k = 0; 8*k < p->buttons; k++)
+        p->state[1+k] = p->pressed >> 8*k;
+    memcpy(data, p->state, p->descr.input_size);
+    return p->descr.input_size;
+}
+
+static struct descr*
+driver_descr(struct device* d)
+{
+    return hid_descr(d->hid);
+}
+
+static size_t
+driver_input(struct device* d, unsigned char* data, size_t size)
+{
+    return hid_transform(d->hid, data, size);
+}
+
+static void
+driver_stop(struct device* d)
+{
+    hid_free(d->hid);
+    d->hid = NULL;
+}
+
+// With the plan in d->hid.
+const struct driver hid_driver = {
+    "HID gamepad", driver_descr, driver_input, NULL,
+    NULL, NULL, NULL, NULL, NULL, driver_stop, 1
+};
+
+
+// Returns the next SDP data element, or 0 if truncated.
+static int
+sdp_element(const unsigned char** q, const unsigned char* end, int* type,
+            const unsigned char** data, size_t* size)
+{
+    if (*q == end)
+        return 0;
+    unsigned char b = *(*q)++;
+    *type = b >> 3;
+    size_t n;
+    if ((b & 7) < 5)
+        n = *type ? 1 << (b & 7) : 0;
+    else {
+        size_t k = 1 << ((b & 7) - 5);
+        if ((size_t)(end - *q) < k)
+            return 0;
+        for (n = 0; k--;)
+            n = n << 8 | *(*q)++;
+    }
+    if ((size_t)(end - *q) < n)
+        return 0;
+    *data = *q;
+    *size = n;
+    *q += n;
+    return 1;
+}
+
+// The HIDDescriptorList attribute is a sequence of sequences of a descriptor
+// type and the descriptor as a string.
+int
+hid_sdp_descriptor(const unsigned char* attr, size_t size,
+                   const unsigned char** data, size_t* data_size)
+{
+    const unsigned char* q = attr, * list;
+    size_t n;
+    int type;
+    if (!sdp_element(&q, attr + size, &type, &list, &n) || type != 6)
+        return 0;
+    for (q = list; q < list + n;) {
+        const unsigned char* seq, * e, * v;
+        size_t m, k;
+        if (!sdp_element(&q, list + n, &type, &seq, &m))
+            return 0;
+        if (type != 6)
+            continue;
+        e = seq;
+        if (!sdp_element(&e, seq + m, &type, &v, &k) || type != 1 || k != 1 ||
+                v[0] != 0x22) // Report
+            continue;
+        if (!sdp_element(&e, seq + m, &type, &v, &k) || type != 4)
+            continue;
+        *data = v;
+        *data_size = k;
+        return 1;
+    }
+    return 0;
+}
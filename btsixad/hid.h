@@ -0,0 +1,24 @@
+#ifndef BTSIXAD_HID_H
+#define BTSIXAD_HID_H
+
+#include "device.h"
+
+// HID devices other than the Sixaxis. As with the Sixaxis, the descriptor
+// provided to programs is our own, here covering the buttons, hat switch and
+// axes of a joystick or gamepad found in the device's descriptor. That is
+// parsed once into a plan for copying them from each input report.
+
+struct hid_plan;
+
+extern const struct driver hid_driver;
+
+struct hid_plan* hid_compile(const unsigned char* data, size_t size,
+                             const char** error);
+void hid_free(struct hid_plan* p);
+struct descr* hid_descr(struct hid_plan* p);
+void hid_summary(struct hid_plan* p, int* buttons, int* hat, int* axes);
+size_t hid_transform(struct hid_plan* p, unsigned char* data, size_t size);
+int hid_sdp_descriptor(const unsigned char* attr, size_t size,
+                       const unsigned char** data, size_t* data_size);
+
+#endif
@@ -0,0 +1,60 @@
+#include "histogram.h"
+
+
+static int
+bucket(uint64_t value)
+{
+    if (value < 8)
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    return (msb-2)*8 + (value >> (msb-3) & 7);
+}
+
+static uint64_t
+bucket_value(int i)
+{
+    if (i < 8)
+        return i;
+    return (uint64_t)(8 + i%8) << (i/8 - 1);
+}
+
+void
+histogram_add(struct histogram* h, uint64_t value)
+{
+    atomic_fetch_add_explicit(&h->count[bucket(value)], 1,
+                              memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, value,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+uint64_t
+histogram_total(struct histogram* h)
+{
+    uint64_t n = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        n += atomic_load_explicit(&h->count[i], memory_order_relaxed);
+    return n;
+}
+
+// The lower bound of the bucket holding the quantile.
+uint64_t
+histogram_quantile(struct histogram* h, double q)
+{
+    uint64_t rank = q * histogram_total(h), n = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        n += atomic_load_explicit(&h->count[i], memory_order_relaxed);
+        if (n > rank)
+            return bucket_value(i);
+    }
+    return histogram_max(h);
+}
+
+uint64_t
+histogram_max(struct histogram* h)
+{
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
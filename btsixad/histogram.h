@@ -0,0 +1,23 @@
+#ifndef BTSIXAD_HISTOGRAM_H
+#define BTSIXAD_HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Log-linear histogram of nanosecond durations: values below 8 are exact,
+// every power of two above is split into 8 buckets, so a bucket is within
+// 12.5% of its values. Adding is lock-free and any thread may read.
+
+#define HISTOGRAM_BUCKETS 496
+
+struct histogram {
+    atomic_uint_fast64_t count[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t max;
+};
+
+void histogram_add(struct histogram* h, uint64_t value);
+uint64_t histogram_total(struct histogram* h);
+uint64_t histogram_quantile(struct histogram* h, double q);
+uint64_t histogram_max(struct histogram* h);
+
+#endif
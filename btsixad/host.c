@@ -1,14 +1,22 @@
 #include "host.h"
 
+#include "capture.h"
 #include "device.h"
+#include "logger.h"
+#include "loop.h"
+#include "pnp.h"
+#include "session.h"
+#include "shm.h"
+#include "sixaxis.h"
+#include "timer.h"
 #include "vuhid.h"
 #include "wrap.h"
 
 #include <bluetooth.h>
 #include <err.h>
 #include <pthread.h>
+#include <signal.h>
 #include <syslog.h>
-#include <sys/queue.h>
 #include <sys/socket.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -17,31 +25,40 @@
 int dflag;
 bdaddr_t bdaddr;
 int timeout;
+int queue_depth = 1;
+int report_cache = 1;
+int change_threshold = -1;
+int output_rate;
+int delivery_rate;
+int stall_gap;
+int stall_action;
 
-struct session {
-    LIST_ENTRY(session) next;
-    struct device d;
-};
-LIST_HEAD(, session) sessions;
-static pthread_mutex_t mutex;
 
+// Print latency statistics of every device and session counts on SIGINFO or
+// SIGUSR1. The signals are blocked in all threads but this one.
+
+static sigset_t stats_signals;
+
+static void
+print_timing(struct device* d, void* _)
+{
+    device_print_timing(d, LOG_INFO);
+}
 
 static void*
-session_run(void* s_void)
+stats_run(void* _)
 {
-    struct session* s = s_void;
-    device_run(&s->d);
-    WR(close(s->d.intr));
-    WR(close(s->d.ctrl));
-    // TODO: is it possible and useful to wait for L2CAP close acknowledged?
-
-    wp(pthread_mutex_lock(&mutex));
-    syslog(LOG_DEBUG, "connection from %s closed",
-           bt_ntoa(&s->d.bdaddr, NULL));
-    LIST_REMOVE(s, next);
-    wp(pthread_mutex_unlock(&mutex));
-    free(s);
-    return NULL;
+    for (;;) {
+        int sig;
+        wp(sigwait(&stats_signals, &sig));
+        session_foreach(print_timing, NULL);
+        struct session_stats stats;
+        session_stats(&stats);
+        logger_printf(LOG_INFO, "sessions: %ju open, %ju started, "
+                      "%ju duplicate channels, %ju half-open reaped",
+                      (uintmax_t)stats.open, (uintmax_t)stats.started,
+                      (uintmax_t)stats.duplicates, (uintmax_t)stats.reaped);
+    }
 }
 
 
@@ -83,31 +100,7 @@ listen_run(void* ctrl_void)
         int flag = 1;
         we(setsockopt(cfd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof flag));
 
-        wp(pthread_mutex_lock(&mutex));
-        syslog(LOG_DEBUG, "connection from %s on %s channel",
-               bt_ntoa(&sa.l2cap_bdaddr, NULL), ctrl ? "control" : "interrupt");
-        struct session* s;
-        LIST_FOREACH(s, &sessions, next)
-            if (bdaddr_same(&s->d.bdaddr, &sa.l2cap_bdaddr))
-                break;
-        if (s && (ctrl ? s->d.ctrl : s->d.intr) != -1)
-            WR(close(cfd));
-        else {
-            if (!s) {
-                s = wm(calloc(1, sizeof *s));
-                wp(pthread_mutex_init(&s->d.mutex, NULL));
-                bdaddr_copy(&s->d.bdaddr, &sa.l2cap_bdaddr);
-                s->d.intr = s->d.ctrl = -1;
-                LIST_INSERT_HEAD(&sessions, s, next);
-            }
-            *(ctrl ? &s->d.ctrl : &s->d.intr) = cfd;
-            if (s->d.ctrl != -1 && s->d.intr != -1) {
-                pthread_t thread;
-                wp(pthread_create(&thread, NULL, session_run, s));
-                wp(pthread_detach(thread));
-            }
-        }
-        wp(pthread_mutex_unlock(&mutex));
+        session_accept(&sa.l2cap_bdaddr, ctrl, cfd);
     }
 }
 
@@ -117,16 +110,69 @@ main(int argc, char* argv[])
 {
     bdaddr_copy(&bdaddr, NG_HCI_BDADDR_ANY);
 
-    int ch;
-    while ((ch = getopt(argc, argv, "a:dt:")) != -1)
+    int ch, loop_threads = 0;
+    const char* capture = NULL, * pnp_cache = NULL, * shm_name = NULL;
+    while ((ch = getopt(argc, argv, "a:c:de:g:m:no:q:r:s:t:w:x")) != -1)
         switch (ch) {
         case 'a':
             if (!bt_aton(optarg, &bdaddr))
                 goto usage;
             break;
+        case 'c': {
+            char* end;
+            change_threshold = strtol(optarg, &end, 10);
+            if (end == optarg || *end || change_threshold < 0)
+                goto usage;
+            break;
+        }
         case 'd':
             dflag++;
             break;
+        case 'e': {
+            char* end;
+            loop_threads = strtol(optarg, &end, 10);
+            if (end == optarg || *end || loop_threads < 0)
+                goto usage;
+            break;
+        }
+        case 'g': {
+            char* end;
+            stall_gap = strtol(optarg, &end, 10);
+            if (end == optarg || *end || stall_gap < 0)
+                goto usage;
+            break;
+        }
+        case 'm':
+            shm_name = optarg;
+            break;
+        case 'n':
+            report_cache = 0;
+            break;
+        case 'o': {
+            char* end;
+            output_rate = strtol(optarg, &end, 10);
+            if (end == optarg || *end || output_rate < 0)
+                goto usage;
+            break;
+        }
+        case 'q': {
+            char* end;
+            queue_depth = strtol(optarg, &end, 10);
+            if (end == optarg || *end ||
+                    queue_depth < 1 || queue_depth > REPORT_MAX_DEPTH)
+                goto usage;
+            break;
+        }
+        case 'r': {
+            char* end;
+            delivery_rate = strtol(optarg, &end, 10);
+            if (end == optarg || *end || delivery_rate < 0)
+                goto usage;
+            break;
+        }
+        case 's':
+            pnp_cache = optarg;
+            break;
         case 't': {
             char* end;
             timeout = strtol(optarg, &end, 10);
@@ -134,30 +180,57 @@ main(int argc, char* argv[])
                 goto usage;
             break;
         }
+        case 'w':
+            capture = optarg;
+            break;
+        case 'x':
+            stall_action++;
+            break;
         default:
             goto usage;
         }
     argc -= optind;
     argv += optind;
-    if (argc)
+    if (argc || stall_action > 2 || stall_action && !stall_gap)
     usage:
-        errx(1, "usage: btsixad [-a bdaddr] [-d] [-t timeout]");
+        errx(1, "usage: btsixad [-a bdaddr] [-c threshold] [-d] [-e threads] "
+             "[-g gap] [-m name] [-n] [-o rate] [-q depth] [-r rate] "
+             "[-s file] [-t timeout] [-w file] [-x]");
 
     openlog("btsixad", LOG_PERROR, LOG_USER);
 
     vuhid_init();
+    sixaxis_init();
+    if (capture)
+        capture_init(capture);
+    if (pnp_cache)
+        pnp_init(pnp_cache);
+    if (shm_name)
+        shm_init(shm_name);
 
     listen_init(1);
     listen_init(0);
 
-    LIST_INIT(&sessions);
-    wp(pthread_mutex_init(&mutex, NULL));
-
     if (!dflag)
         if (daemon(0, 0) == -1)
             err(1, "daemon() failed");
 
+    we(sigemptyset(&stats_signals));
+    we(sigaddset(&stats_signals, SIGINFO));
+    we(sigaddset(&stats_signals, SIGUSR1));
+    wp(pthread_sigmask(SIG_BLOCK, &stats_signals, NULL));
+    logger_start();
+    pthread_t stats_thread;
+    wp(pthread_create(&stats_thread, NULL, stats_run, NULL));
+    wp(pthread_detach(stats_thread));
+
     vuhid_start();
+    loop_start(loop_threads);
+    timer_start();
+    capture_start();
+    pnp_start();
+    shm_start();
+    session_start(NULL, SESSION_HALF_OPEN_MS);
 
     pthread_t ctrl_thread, intr_thread;
     wp(pthread_create(&ctrl_thread, NULL, listen_run, ""));
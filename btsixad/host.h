@@ -7,5 +7,12 @@
 extern int dflag;
 extern bdaddr_t bdaddr;
 extern int timeout;
+extern int queue_depth;
+extern int report_cache;
+extern int change_threshold;
+extern int output_rate;
+extern int delivery_rate;
+extern int stall_gap;
+extern int stall_action;
 
 #endif
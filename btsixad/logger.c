@@ -0,0 +1,289 @@
+#include "logger.h"
+
+#include "wrap.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// Every thread that logs gets its own ring, which only it writes and only the
+// logger thread reads, so logging never waits for a lock or for output. The
+// message is formatted into the ring, but data is copied as is and converted
+// to hex by the logger thread. If a ring is full, the record is dropped and
+// counted.
+
+// Records carry a global sequence number so that the logger thread can put
+// those from different threads back in order.
+
+#define LOGGER_RING_SIZE (1 << 16)
+#define LOGGER_MAX_TEXT 512
+#define LOGGER_MAX_DATA 1024
+
+// Output is not urgent, so the logger thread gathers records for a while
+// after it is woken up, which also limits the number of wakeups.
+#define LOGGER_BATCH_NS 10000000
+
+struct record {
+    uint64_t seq;
+    int priority;
+    uint16_t text, size; // bytes of message and of data that follow
+};
+
+struct ring {
+    struct ring* next;
+    atomic_size_t head, tail; // total bytes put and taken
+    atomic_int dead; // the thread has exited
+    unsigned char data[LOGGER_RING_SIZE];
+};
+
+static int started;
+static pthread_key_t ring_key;
+static _Thread_local struct ring* own;
+static _Atomic(struct ring*) incoming; // new rings not seen by the logger
+static atomic_uint_fast64_t seq, dropped;
+static atomic_int awake;
+static int wake_pipe[2];
+
+
+static void
+emit(int priority, const char* text, size_t text_size,
+     const unsigned char* data, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    char line[LOGGER_MAX_TEXT + 2*LOGGER_MAX_DATA + 1];
+    memcpy(line, text, text_size);
+    char* p = line + text_size;
+    for (size_t i = 0; i < size; i++) {
+        *p++ = digits[data[i] >> 4];
+        *p++ = digits[data[i] & 0xf];
+    }
+    if (priority == LOGGER_STDOUT) {
+        *p++ = '\n';
+        fwrite(line, 1, p - line, stdout);
+    } else {
+        fflush(stdout); // keep the order with LOG_PERROR
+        syslog(priority, "%.*s", (int)(p - line), line);
+    }
+}
+
+static void
+ring_copy_in(struct ring* r, size_t at, const void* data, size_t size)
+{
+    size_t i = at % LOGGER_RING_SIZE, k = LOGGER_RING_SIZE - i;
+    if (k > size)
+        k = size;
+    memcpy(r->data+i, data, k);
+    memcpy(r->data, (const unsigned char*)data+k, size-k);
+}
+
+static void
+ring_copy_out(struct ring* r, size_t at, void* data, size_t size)
+{
+    size_t i = at % LOGGER_RING_SIZE, k = LOGGER_RING_SIZE - i;
+    if (k > size)
+        k = size;
+    memcpy(data, r->data+i, k);
+    memcpy((unsigned char*)data+k, r->data, size-k);
+}
+
+static void
+ring_exit(void* r_void)
+{
+    struct ring* r = r_void;
+    own = NULL;
+    atomic_store(&r->dead, 1); // freed by the logger thread once drained
+}
+
+static struct ring*
+own_ring()
+{
+    if (!own) {
+        own = wm(calloc(1, sizeof *own));
+        wp(pthread_setspecific(ring_key, own));
+        own->next = atomic_load(&incoming);
+        while (!atomic_compare_exchange_weak(&incoming, &own->next, own))
+            ;
+    }
+    return own;
+}
+
+static void
+put(int priority, const char* text, size_t text_size,
+    const void* data, size_t size)
+{
+    if (text_size > LOGGER_MAX_TEXT)
+        text_size = LOGGER_MAX_TEXT;
+    if (size > LOGGER_MAX_DATA)
+        size = LOGGER_MAX_DATA;
+    if (!started) { // only this thread yet
+        emit(priority, text, text_size, data, size);
+        return;
+    }
+
+    struct ring* r = own_ring();
+    struct record h = {
+        atomic_fetch_add_explicit(&seq, 1, memory_order_relaxed),
+        priority, text_size, size
+    };
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t n = sizeof h + text_size + size;
+    if (head - atomic_load(&r->tail) + n > LOGGER_RING_SIZE) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring_copy_in(r, head, &h, sizeof h);
+    ring_copy_in(r, head + sizeof h, text, text_size);
+    ring_copy_in(r, head + sizeof h + text_size, data, size);
+    atomic_store(&r->head, head + n);
+
+    // The logger thread clears awake before checking the rings once more, so
+    // either it sees this record or this sees it asleep.
+    if (!atomic_load(&awake) && !atomic_exchange(&awake, 1)) {
+        char c = 0;
+        write(wake_pipe[1], &c, 1); // if the pipe is full, a wakeup is pending
+    }
+}
+
+void
+logger_printf(int priority, const char* format, ...)
+{
+    char text[LOGGER_MAX_TEXT];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(text, sizeof text, format, ap);
+    va_end(ap);
+    if (n >= (int)sizeof text)
+        n = sizeof text - 1; // truncated, without the NUL
+    put(priority, text, n < 0 ? 0 : n, NULL, 0);
+}
+
+void
+logger_hex(int priority, const void* data, size_t size,
+           const char* format, ...)
+{
+    char text[LOGGER_MAX_TEXT];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(text, sizeof text, format, ap);
+    va_end(ap);
+    if (n >= (int)sizeof text)
+        n = sizeof text - 1; // truncated, without the NUL
+    put(priority, text, n < 0 ? 0 : n, data, size);
+}
+
+
+static struct ring* rings; // owned by the logger thread
+
+// Write out all records in order and return whether there were any.
+static int
+drain()
+{
+    struct ring* r = atomic_exchange(&incoming, NULL);
+    if (r) {
+        struct ring* last = r;
+        while (last->next)
+            last = last->next;
+        last->next = rings;
+        rings = r;
+    }
+
+    int any = 0;
+    for (;;) {
+        struct ring* first = NULL;
+        struct record h, first_h;
+        for (r = rings; r; r = r->next) {
+            size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            if (atomic_load(&r->head) == tail)
+                continue;
+            ring_copy_out(r, tail, &h, sizeof h);
+            if (!first || h.seq < first_h.seq) {
+                first = r;
+                first_h = h;
+            }
+        }
+        if (!first)
+            break;
+        any = 1;
+
+        char text[LOGGER_MAX_TEXT];
+        unsigned char data[LOGGER_MAX_DATA];
+        size_t tail = atomic_load_explicit(&first->tail, memory_order_relaxed);
+        ring_copy_out(first, tail + sizeof h, text, first_h.text);
+        ring_copy_out(first, tail + sizeof h + first_h.text,
+                      data, first_h.size);
+        atomic_store(&first->tail,
+                     tail + sizeof h + first_h.text + first_h.size);
+        emit(first_h.priority, text, first_h.text, data, first_h.size);
+    }
+    fflush(stdout);
+    return any;
+}
+
+static void
+free_dead()
+{
+    for (struct ring** p = &rings; *p;) {
+        struct ring* r = *p;
+        if (atomic_load(&r->dead) &&
+                atomic_load(&r->head) == atomic_load(&r->tail)) {
+            *p = r->next;
+            free(r);
+        } else
+            p = &r->next;
+    }
+}
+
+static void*
+logger_run(void* _)
+{
+    uint64_t reported = 0;
+    time_t reported_at = 0;
+    for (;;) {
+        do {
+            atomic_store(&awake, 1);
+            drain();
+            atomic_store(&awake, 0);
+        } while (drain());
+        free_dead();
+
+        // at most once a second while dropping
+        uint64_t n = atomic_load_explicit(&dropped, memory_order_relaxed);
+        struct timespec now;
+        we(clock_gettime(CLOCK_MONOTONIC, &now));
+        if (n != reported && now.tv_sec != reported_at) {
+            syslog(LOG_WARNING, "%ju log messages dropped so far",
+                   (uintmax_t)n);
+            reported = n;
+            reported_at = now.tv_sec;
+        }
+
+        char buf[64];
+        if (!WR(read(wake_pipe[0], buf, sizeof buf)))
+            errx(1, "logger pipe closed");
+        struct timespec t = { 0, LOGGER_BATCH_NS };
+        while (nanosleep(&t, &t))
+            ;
+    }
+}
+
+// After daemon() and before any other thread is created. Until then messages
+// are output directly.
+void
+logger_start()
+{
+    wp(pthread_key_create(&ring_key, ring_exit));
+    we(pipe(wake_pipe));
+    we(fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK));
+    pthread_t thread;
+    wp(pthread_create(&thread, NULL, logger_run, NULL));
+    wp(pthread_detach(thread));
+    started = 1;
+}
@@ -0,0 +1,17 @@
+#ifndef BTSIXAD_LOGGER_H
+#define BTSIXAD_LOGGER_H
+
+#include <stddef.h>
+
+// Priority of messages printed on standard output instead of logged.
+#define LOGGER_STDOUT -1
+
+void logger_start();
+void logger_printf(int priority, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+// The message is followed by data in hex.
+void logger_hex(int priority, const void* data, size_t size,
+                const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#endif
@@ -0,0 +1,100 @@
+#include "loop.h"
+
+#include "device.h"
+#include "logger.h"
+#include "wrap.h"
+
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+
+// Optional replacement for the ctrl and intr threads of every device: a few
+// threads wait on a shared kqueue and run whichever channel has a message.
+// Each socket is registered with EV_DISPATCH, so only one thread handles it at
+// a time and messages of a channel are processed in order. Re-enabling is
+// batched with the next wait, so a busy loop thread makes one kevent() call
+// for many reports.
+
+#define LOOP_EVENTS 32
+
+static int kq = -1;
+
+static void*
+loop_run(void* _)
+{
+    unsigned char buf[DEVICE_MAX_REPORT_SIZE];
+    struct kevent changes[LOOP_EVENTS], events[LOOP_EVENTS];
+    int nchanges = 0;
+    for (;;) {
+        int n = kevent(kq, changes, nchanges, events, LOOP_EVENTS, NULL);
+        if (n == -1) {
+            if (errno != EINTR)
+                err(1, "kevent() failed");
+            n = 0;
+        }
+        nchanges = 0;
+        for (int i = 0; i < n; i++) {
+            struct device* d = events[i].udata;
+            int fd = events[i].ident;
+            if (events[i].flags & EV_ERROR) {
+                // The channel can't be waited for, which ends only its device.
+                char addr[32];
+                logger_printf(LOG_WARNING, "%s: kevent() failed: %s",
+                              bt_ntoa(&d->bdaddr, addr),
+                              strerror(events[i].data));
+                device_disconnect(d);
+                device_finished(d);
+                continue;
+            }
+            if (device_process(d, fd == d->ctrl, 1, buf)) {
+                EV_SET(&changes[nchanges], fd, EVFILT_READ, EV_ENABLE,
+                       0, 0, d);
+                nchanges++;
+            } else {
+                // Must be gone from the kqueue before the device learns that
+                // the channel is finished and its descriptor is closed.
+                struct kevent ev;
+                EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+                we(kevent(kq, &ev, 1, NULL, 0, NULL));
+                device_finished(d);
+            }
+        }
+    }
+}
+
+void
+loop_start(int threads)
+{
+    assert(kq == -1);
+    if (!threads)
+        return;
+
+    kq = kqueue();
+    if (kq == -1)
+        err(1, "kqueue() failed");
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        wp(pthread_create(&thread, NULL, loop_run, NULL));
+        wp(pthread_detach(thread));
+    }
+}
+
+int
+loop_add(struct device* d)
+{
+    if (kq == -1)
+        return 0;
+
+    struct kevent ev[2];
+    EV_SET(&ev[0], d->ctrl, EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0, d);
+    EV_SET(&ev[1], d->intr, EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0, d);
+    we(kevent(kq, ev, 2, NULL, 0, NULL));
+    return 1;
+}
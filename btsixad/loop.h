@@ -0,0 +1,9 @@
+#ifndef BTSIXAD_LOOP_H
+#define BTSIXAD_LOOP_H
+
+#include "device.h"
+
+void loop_start(int threads);
+int loop_add(struct device* d);
+
+#endif
@@ -0,0 +1,235 @@
+#include "mux.h"
+
+#include "btsixa.h"
+#include "vuhid.h"
+#include "wrap.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// While the aggregate node is open, a device is queued when it gets a report
+// and a read takes records off the queue for as many devices as fit, so a
+// reader that falls behind gets every device's report with one read instead
+// of one read per device. Like a device node without a queue, only the latest
+// report of each device is delivered, and its sequence number shows how many
+// were skipped.
+//
+// Watching a device sends it control requests, which may wait for its channel
+// threads, so that is done under a separate mutex that they never take.
+
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, device) attached = LIST_HEAD_INITIALIZER(attached);
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int opened; // changed under both mutexes
+static atomic_int listening; // opened, checked first without the mutex
+static TAILQ_HEAD(, device) pending = TAILQ_HEAD_INITIALIZER(pending);
+static int* gone; // units detached since the last read
+static size_t n_gone, max_gone;
+static int waiting;
+
+
+// With the mutex held. Returns whether the queue was empty, in which case
+// the caller wakes up pollers after unlocking.
+static int
+wake()
+{
+    int empty = TAILQ_EMPTY(&pending) && !n_gone;
+    if (empty && waiting)
+        wp(pthread_cond_signal(&cond));
+    return empty;
+}
+
+void
+mux_attach(struct device* d)
+{
+    wp(pthread_mutex_lock(&watch_mutex));
+    LIST_INSERT_HEAD(&attached, d, mux_next);
+    wp(pthread_mutex_lock(&mutex));
+    d->mux_attached = 1;
+    d->mux_queued = 0;
+    d->mux_seen = report_count(&d->input);
+    wp(pthread_mutex_unlock(&mutex));
+    if (opened)
+        device_watch(d, 1);
+    wp(pthread_mutex_unlock(&watch_mutex));
+}
+
+void
+mux_detach(struct device* d)
+{
+    wp(pthread_mutex_lock(&watch_mutex));
+    LIST_REMOVE(d, mux_next);
+    wp(pthread_mutex_lock(&mutex));
+    d->mux_attached = 0;
+    if (d->mux_queued)
+        TAILQ_REMOVE(&pending, d, mux_pending);
+    int empty = 0;
+    if (opened) {
+        empty = wake();
+        if (n_gone == max_gone) {
+            max_gone = max_gone ? 2*max_gone : 16;
+            gone = wm(realloc(gone, max_gone * sizeof *gone));
+        }
+        gone[n_gone++] = d->unit;
+    }
+    wp(pthread_mutex_unlock(&mutex));
+    wp(pthread_mutex_unlock(&watch_mutex));
+    if (empty)
+        vuhid_wakeup();
+}
+
+// After each report put, so this is free unless the node is open.
+void
+mux_notify(struct device* d)
+{
+    if (!atomic_load_explicit(&listening, memory_order_relaxed))
+        return;
+    int empty = 0;
+    wp(pthread_mutex_lock(&mutex));
+    if (opened && d->mux_attached && !d->mux_queued) {
+        empty = wake();
+        TAILQ_INSERT_TAIL(&pending, d, mux_pending);
+        d->mux_queued = 1;
+    }
+    wp(pthread_mutex_unlock(&mutex));
+    if (empty)
+        vuhid_wakeup();
+}
+
+int
+mux_open()
+{
+    wp(pthread_mutex_lock(&watch_mutex));
+    int r = !opened;
+    if (r) {
+        struct device* d;
+        wp(pthread_mutex_lock(&mutex));
+        opened = 1;
+        // Reports received while closed are not delivered.
+        LIST_FOREACH(d, &attached, mux_next)
+            d->mux_seen = report_count(&d->input);
+        wp(pthread_mutex_unlock(&mutex));
+        atomic_store(&listening, 1);
+        LIST_FOREACH(d, &attached, mux_next)
+            device_watch(d, 1);
+    }
+    wp(pthread_mutex_unlock(&watch_mutex));
+    return r;
+}
+
+void
+mux_close()
+{
+    wp(pthread_mutex_lock(&watch_mutex));
+    atomic_store(&listening, 0);
+    wp(pthread_mutex_lock(&mutex));
+    opened = 0;
+    struct device* d;
+    while ((d = TAILQ_FIRST(&pending))) {
+        TAILQ_REMOVE(&pending, d, mux_pending);
+        d->mux_queued = 0;
+    }
+    n_gone = 0;
+    wp(pthread_cond_broadcast(&cond));
+    wp(pthread_mutex_unlock(&mutex));
+    LIST_FOREACH(d, &attached, mux_next)
+        device_watch(d, 0);
+    wp(pthread_mutex_unlock(&watch_mutex));
+}
+
+static void
+put_record(unsigned char* buf, size_t len, size_t* size,
+           int unit, size_t n, uint64_t seq)
+{
+    struct btsixa_mux_record h = { unit, n, seq };
+    memcpy(buf + *size, &h, sizeof h);
+    size_t end = *size + sizeof h + n;
+    *size = end + (BTSIXA_MUX_ALIGN - end % BTSIXA_MUX_ALIGN) %
+                  BTSIXA_MUX_ALIGN;
+    if (*size > len)
+        *size = len;
+    memset(buf + end, 0, *size - end);
+}
+
+// With the mutex held. The first record always fits, if truncated.
+static void
+fill(unsigned char* buf, size_t len, size_t* size)
+{
+    size_t header = sizeof(struct btsixa_mux_record), i;
+    for (i = 0; i < n_gone && len - *size >= header; i++)
+        put_record(buf, len, size, gone[i], 0, 0);
+    memmove(gone, gone + i, (n_gone - i) * sizeof *gone);
+    n_gone -= i;
+
+    struct device* d;
+    while ((d = TAILQ_FIRST(&pending))) {
+        size_t room = len - *size;
+        if (room < header || *size && room < header + d->descr->input_size)
+            break;
+        TAILQ_REMOVE(&pending, d, mux_pending);
+        d->mux_queued = 0;
+        size_t n = room - header;
+        uint64_t seq = report_latest(&d->input, d->mux_seen,
+                                     buf + *size + header, &n);
+        if (!seq)
+            continue; // already delivered
+        d->mux_seen = seq;
+        put_record(buf, len, size, d->unit, n, seq);
+    }
+}
+
+// Returns 0 if cancelled or closed while waiting, otherwise size is 0 only if
+// nonblock and nothing is ready.
+int
+mux_read(int nonblock, unsigned char* buf, size_t* size)
+{
+    size_t len = *size;
+    assert(len >= sizeof(struct btsixa_mux_record));
+    *size = 0;
+    int r = 1;
+    wp(pthread_mutex_lock(&mutex));
+    for (;;) {
+        if (!opened) {
+            r = 0;
+            break;
+        }
+        if (!TAILQ_EMPTY(&pending) || n_gone) {
+            fill(buf, len, size);
+            if (*size)
+                break;
+        } else if (nonblock)
+            break;
+        else if (vuhid_cancelled()) {
+            r = 0;
+            break;
+        } else {
+            waiting++;
+            wp(pthread_cond_wait(&cond, &mutex));
+            waiting--;
+        }
+    }
+    wp(pthread_mutex_unlock(&mutex));
+    return r;
+}
+
+int
+mux_ready()
+{
+    wp(pthread_mutex_lock(&mutex));
+    int r = !TAILQ_EMPTY(&pending) || n_gone;
+    wp(pthread_mutex_unlock(&mutex));
+    return r;
+}
+
+void
+mux_wakeup()
+{
+    wp(pthread_mutex_lock(&mutex));
+    wp(pthread_cond_broadcast(&cond));
+    wp(pthread_mutex_unlock(&mutex));
+}
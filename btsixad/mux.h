@@ -0,0 +1,18 @@
+#ifndef BTSIXAD_MUX_H
+#define BTSIXAD_MUX_H
+
+#include "device.h"
+
+// The aggregate node: the input reports of all devices with a node, tagged
+// with the unit number, through one reader.
+
+void mux_attach(struct device* d);
+void mux_detach(struct device* d);
+void mux_notify(struct device* d);
+int mux_open();
+void mux_close();
+int mux_read(int nonblock, unsigned char* buf, size_t* size);
+int mux_ready();
+void mux_wakeup();
+
+#endif
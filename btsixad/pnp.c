@@ -0,0 +1,265 @@
+#include "pnp.h"
+
+#include "logger.h"
+#include "wrap.h"
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/queue.h>
+
+
+// The Device ID of a paired device doesn't change, so it is cached in a text
+// file to save an SDP connection and search on every reconnection. Cached
+// answers are checked in the background some time after the device connects,
+// when it is no longer busy being set up, and the file is rewritten by the
+// same thread whenever the cache changes.
+
+#define PNP_REVALIDATE_DELAY 5 // seconds
+#define PNP_PENDING 16 // revalidations not done yet, others are skipped
+
+struct entry {
+    LIST_ENTRY(entry) next;
+    bdaddr_t bdaddr;
+    struct pnp_info info;
+};
+
+static char* path; // NULL if not caching
+static int started;
+static LIST_HEAD(, entry) entries = LIST_HEAD_INITIALIZER(entries);
+static int dirty;
+static struct {
+    bdaddr_t bdaddr;
+    pnp_query* query;
+    time_t due;
+} pending[PNP_PENDING];
+static int first_pending, n_pending;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+
+
+static struct entry*
+find(const bdaddr_t* bdaddr)
+{
+    struct entry* e;
+    LIST_FOREACH(e, &entries, next)
+        if (bdaddr_same(&e->bdaddr, bdaddr))
+            break;
+    return e;
+}
+
+static void
+put(const bdaddr_t* bdaddr, const struct pnp_info* info)
+{
+    struct entry* e = find(bdaddr);
+    if (!e) {
+        e = wm(malloc(sizeof *e));
+        bdaddr_copy(&e->bdaddr, bdaddr);
+        LIST_INSERT_HEAD(&entries, e, next);
+    } else if (!memcmp(&e->info, info, sizeof *info))
+        return;
+    e->info = *info;
+    dirty = 1;
+}
+
+static time_t
+now()
+{
+    struct timespec t;
+    we(clock_gettime(CLOCK_MONOTONIC, &t));
+    return t.tv_sec;
+}
+
+// Called with the mutex held, releases it while writing.
+static void
+save()
+{
+    char* buf;
+    size_t size;
+    FILE* f = open_memstream(&buf, &size);
+    if (!f)
+        err(1, "open_memstream() failed");
+    fprintf(f, "# address vendor product release source\n");
+    struct entry* e;
+    LIST_FOREACH(e, &entries, next) {
+        char a[32];
+        fprintf(f, "%s 0x%04x 0x%04x 0x%04x 0x%04x\n",
+                bt_ntoa(&e->bdaddr, a), e->info.vendor, e->info.product,
+                e->info.release, e->info.source);
+    }
+    if (fclose(f))
+        err(1, "open_memstream() failed");
+    dirty = 0;
+    wp(pthread_mutex_unlock(&mutex));
+
+    // Replace the file in one step so that it's never seen half written.
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f || fwrite(buf, 1, size, f) != size | fclose(f) ||
+            rename(tmp, path) == -1)
+        logger_printf(LOG_WARNING, "can't write %s: %s", path,
+                      strerror(errno));
+    free(buf);
+    wp(pthread_mutex_lock(&mutex));
+}
+
+static void*
+pnp_run(void* _)
+{
+    wp(pthread_mutex_lock(&mutex));
+    for (;;) {
+        if (dirty)
+            save();
+        else if (!n_pending)
+            wp(pthread_cond_wait(&cond, &mutex));
+        else if (pending[first_pending].due > now()) {
+            struct timespec until = { pending[first_pending].due };
+            int r = pthread_cond_timedwait(&cond, &mutex, &until);
+            if (r != ETIMEDOUT)
+                wp(r);
+        } else {
+            bdaddr_t bdaddr;
+            bdaddr_copy(&bdaddr, &pending[first_pending].bdaddr);
+            pnp_query* query = pending[first_pending].query;
+            first_pending = (first_pending + 1) % PNP_PENDING;
+            n_pending--;
+            wp(pthread_mutex_unlock(&mutex));
+
+            struct pnp_info info;
+            int ok = query(&bdaddr, &info);
+
+            wp(pthread_mutex_lock(&mutex));
+            struct entry* e = find(&bdaddr);
+            if (ok && e && memcmp(&e->info, &info, sizeof info)) {
+                char a[32];
+                logger_printf(LOG_NOTICE, "device information of %s changed",
+                              bt_ntoa(&bdaddr, a));
+                put(&bdaddr, &info);
+            }
+        }
+    }
+}
+
+static void
+revalidate(const bdaddr_t* bdaddr, pnp_query* query)
+{
+    for (int i = 0; i < n_pending; i++)
+        if (bdaddr_same(&pending[(first_pending + i) % PNP_PENDING].bdaddr,
+                        bdaddr))
+            return;
+    if (n_pending == PNP_PENDING)
+        return;
+    int i = (first_pending + n_pending++) % PNP_PENDING;
+    bdaddr_copy(&pending[i].bdaddr, bdaddr);
+    pending[i].query = query;
+    pending[i].due = now() + PNP_REVALIDATE_DELAY;
+    wp(pthread_cond_signal(&cond));
+}
+
+
+// Before daemon(), which changes the directory, so that the path may be
+// relative.
+void
+pnp_init(const char* path_)
+{
+    char buf[PATH_MAX] = "";
+    if (path_[0] != '/') {
+        if (!getcwd(buf, sizeof buf - 1))
+            err(1, "getcwd() failed");
+        strcat(buf, "/");
+    }
+    if (strlcat(buf, path_, sizeof buf) >= sizeof buf)
+        errx(1, "%s: path too long", path_);
+    path = wm(strdup(buf));
+
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        if (errno != ENOENT)
+            err(1, "%s", path);
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof line, f)) {
+        char a[32];
+        unsigned v[4];
+        bdaddr_t bdaddr;
+        if (line[0] == '#' ||
+                sscanf(line, "%31s %x %x %x %x", a, &v[0], &v[1], &v[2],
+                       &v[3]) != 5 ||
+                !bt_aton(a, &bdaddr))
+            continue;
+        struct pnp_info info = { v[0], v[1], v[2], v[3] };
+        put(&bdaddr, &info);
+    }
+    fclose(f);
+    dirty = 0;
+}
+
+void
+pnp_start()
+{
+    if (!path)
+        return;
+    pthread_condattr_t condattr;
+    wp(pthread_condattr_init(&condattr));
+    wp(pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC));
+    wp(pthread_cond_init(&cond, &condattr));
+    wp(pthread_condattr_destroy(&condattr));
+
+    pthread_t thread;
+    wp(pthread_create(&thread, NULL, pnp_run, NULL));
+    wp(pthread_detach(thread));
+    started = 1;
+}
+
+// A cached answer is returned at once and checked later, otherwise the query
+// is made now.
+int
+pnp_lookup(const bdaddr_t* bdaddr, struct pnp_info* info, pnp_query* query)
+{
+    if (!started)
+        return query(bdaddr, info);
+
+    wp(pthread_mutex_lock(&mutex));
+    struct entry* e = find(bdaddr);
+    if (e) {
+        *info = e->info;
+        revalidate(bdaddr, query);
+    }
+    wp(pthread_mutex_unlock(&mutex));
+    if (e)
+        return 1;
+
+    if (!query(bdaddr, info))
+        return 0;
+    wp(pthread_mutex_lock(&mutex));
+    put(bdaddr, info);
+    wp(pthread_cond_signal(&cond));
+    wp(pthread_mutex_unlock(&mutex));
+    return 1;
+}
+
+// The device was unpaired.
+void
+pnp_forget(const bdaddr_t* bdaddr)
+{
+    if (!started)
+        return;
+    wp(pthread_mutex_lock(&mutex));
+    struct entry* e = find(bdaddr);
+    if (e) {
+        LIST_REMOVE(e, next);
+        free(e);
+        dirty = 1;
+        wp(pthread_cond_signal(&cond));
+    }
+    wp(pthread_mutex_unlock(&mutex));
+}
@@ -0,0 +1,22 @@
+#ifndef BTSIXAD_PNP_H
+#define BTSIXAD_PNP_H
+
+#define L2CAP_SOCKET_CHECKED
+#include <bluetooth.h>
+#include <stdint.h>
+
+// Device ID (PnP Information) of a device, as found over SDP.
+struct pnp_info {
+    uint16_t vendor, product, release, source;
+};
+
+// Returns 0 on failure.
+typedef int pnp_query(const bdaddr_t* bdaddr, struct pnp_info* info);
+
+void pnp_init(const char* path);
+void pnp_start();
+int pnp_lookup(const bdaddr_t* bdaddr, struct pnp_info* info,
+               pnp_query* query);
+void pnp_forget(const bdaddr_t* bdaddr);
+
+#endif
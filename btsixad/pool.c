@@ -0,0 +1,61 @@
+#include "pool.h"
+
+#include "wrap.h"
+
+#include <err.h>
+
+
+static void*
+worker_run(void* p_void)
+{
+    struct pool* p = p_void;
+    for (;;) {
+        if (p->wait_and_process())
+            errx(1, "worker failed");
+        // This one is waiting again unless it leaves.
+        wp(pthread_mutex_lock(&p->mutex));
+        int leave = p->workers - p->busy > p->idle;
+        if (leave)
+            p->workers--;
+        wp(pthread_mutex_unlock(&p->mutex));
+        if (leave)
+            return NULL;
+    }
+}
+
+static void
+add_worker(struct pool* p)
+{
+    pthread_t worker;
+    wp(pthread_create(&worker, NULL, worker_run, p));
+    wp(pthread_detach(worker));
+}
+
+void
+pool_start(struct pool* p)
+{
+    wp(pthread_mutex_init(&p->mutex, NULL));
+    p->workers = p->peak = p->idle;
+    for (int i = 0; i < p->idle; i++)
+        add_worker(p);
+}
+
+void
+pool_enter(struct pool* p)
+{
+    wp(pthread_mutex_lock(&p->mutex));
+    int add = ++p->busy == p->workers && p->workers < p->max;
+    if (add && ++p->workers > p->peak)
+        p->peak = p->workers;
+    wp(pthread_mutex_unlock(&p->mutex));
+    if (add)
+        add_worker(p);
+}
+
+void
+pool_leave(struct pool* p)
+{
+    wp(pthread_mutex_lock(&p->mutex));
+    p->busy--;
+    wp(pthread_mutex_unlock(&p->mutex));
+}
@@ -0,0 +1,22 @@
+#ifndef BTSIXAD_POOL_H
+#define BTSIXAD_POOL_H
+
+#include <pthread.h>
+
+// Worker threads that each wait for and process one request at a time. A
+// request that may block brackets itself with pool_enter() and pool_leave(),
+// and a worker is added whenever no other one is left waiting.
+struct pool {
+    int (*wait_and_process)(); // nonzero on failure
+    int idle; // workers kept waiting, and started with
+    int max; // workers at most
+    // private, zero-initialized:
+    pthread_mutex_t mutex;
+    int workers, busy, peak;
+};
+
+void pool_start(struct pool* p);
+void pool_enter(struct pool* p);
+void pool_leave(struct pool* p);
+
+#endif
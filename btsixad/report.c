@@ -0,0 +1,226 @@
+#include "report.h"
+
+#include "wrap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// The buffer is a ring of REPORT_MAX_DEPTH seqlocks: the producer makes the
+// sequence number of a slot odd, copies the report and makes it even again,
+// so a consumer can tell whether its copy is consistent and retry if not. The
+// producer never waits for consumers and simply overwrites the oldest slot.
+// After report n is completely written, head is n+1 and the sequence number
+// of slot n % REPORT_MAX_DEPTH is 2*n+2. The depth only limits how far behind
+// head a consumer may start reading, so it can change at any time.
+
+void
+report_init(struct report_buf* b, size_t max_size)
+{
+    atomic_init(&b->head, 0);
+    atomic_init(&b->tail, 0);
+    atomic_init(&b->depth, 1);
+    atomic_init(&b->overruns, 0);
+    b->data = wm(malloc(REPORT_MAX_DEPTH * max_size));
+    for (int i = 0; i < REPORT_MAX_DEPTH; i++) {
+        atomic_init(&b->slots[i].seq, 0);
+        b->slots[i].size = 0;
+        b->slots[i].stamp = (struct report_stamp){ 0 };
+        b->slots[i].data = b->data + i*max_size;
+    }
+    b->max_size = max_size;
+    atomic_init(&b->waiters, 0);
+    b->closed = 0;
+    b->stalled = 0;
+
+    wp(pthread_mutex_init(&b->mutex, NULL));
+    wp(pthread_cond_init(&b->cond, NULL));
+}
+
+void
+report_destroy(struct report_buf* b)
+{
+    wp(pthread_cond_destroy(&b->cond));
+    wp(pthread_mutex_destroy(&b->mutex));
+    free(b->data);
+}
+
+void
+report_wakeup(struct report_buf* b)
+{
+    // Pairs with the increment in report_wait: either we see the waiter or
+    // the waiter sees the new head before sleeping.
+    if (atomic_load(&b->waiters)) {
+        wp(pthread_mutex_lock(&b->mutex));
+        wp(pthread_cond_broadcast(&b->cond));
+        wp(pthread_mutex_unlock(&b->mutex));
+    }
+}
+
+void
+report_put(struct report_buf* b, const unsigned char* data, size_t size,
+           const struct report_stamp* stamp)
+{
+    if (size > b->max_size)
+        size = b->max_size;
+    uint_fast64_t n = atomic_load_explicit(&b->head, memory_order_relaxed);
+    struct report_slot* slot = &b->slots[n % REPORT_MAX_DEPTH];
+    atomic_store_explicit(&slot->seq, 2*n+1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(slot->data, data, size);
+    slot->size = size;
+    if (stamp)
+        slot->stamp = *stamp;
+    // head first, so that a consumer never consumes past it
+    atomic_store(&b->head, n+1);
+    atomic_store_explicit(&slot->seq, 2*n+2, memory_order_release);
+    report_wakeup(b);
+}
+
+int
+report_get(struct report_buf* b, unsigned char* data, size_t* size,
+           struct report_stamp* stamp)
+{
+    for (;;) {
+        uint_fast64_t tail = atomic_load(&b->tail);
+        uint_fast64_t head = atomic_load(&b->head);
+        if (head == tail)
+            return 0;
+        uint_fast64_t n = tail, depth = atomic_load(&b->depth);
+        if (head - tail > depth)
+            n = head - depth; // skip to the oldest report still wanted
+        struct report_slot* slot = &b->slots[n % REPORT_MAX_DEPTH];
+        uint_fast64_t seq =
+            atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != 2*n+2)
+            continue; // being written, which is quick, or overwritten
+        size_t k = slot->size;
+        if (k > *size)
+            k = *size;
+        memcpy(data, slot->data, k);
+        struct report_stamp s = slot->stamp;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue; // overwritten while copying
+        // Another consumer may have taken it in the meantime.
+        if (!atomic_compare_exchange_strong(&b->tail, &tail, n+1))
+            continue;
+        // Keeping only the latest report skips the others by design.
+        if (n > tail && depth > 1)
+            atomic_fetch_add(&b->overruns, n - tail);
+        *size = k;
+        if (stamp)
+            *stamp = s;
+        return 1;
+    }
+}
+
+// Copy the latest report without consuming it, if there were more than since.
+// Returns its number counting from 1, or 0.
+uint64_t
+report_latest(struct report_buf* b, uint64_t since,
+              unsigned char* data, size_t* size)
+{
+    for (;;) {
+        uint_fast64_t head = atomic_load(&b->head);
+        if (head <= since)
+            return 0;
+        uint_fast64_t n = head-1;
+        struct report_slot* slot = &b->slots[n % REPORT_MAX_DEPTH];
+        uint_fast64_t seq =
+            atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != 2*n+2)
+            continue;
+        size_t k = slot->size;
+        if (k > *size)
+            k = *size;
+        memcpy(data, slot->data, k);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue;
+        *size = k;
+        return head;
+    }
+}
+
+int
+report_ready(struct report_buf* b)
+{
+    return atomic_load(&b->head) != atomic_load(&b->tail);
+}
+
+void
+report_discard(struct report_buf* b)
+{
+    atomic_store(&b->tail, atomic_load(&b->head));
+}
+
+void
+report_set_depth(struct report_buf* b, int depth)
+{
+    if (depth < 1)
+        depth = 1;
+    if (depth > REPORT_MAX_DEPTH)
+        depth = REPORT_MAX_DEPTH;
+    atomic_store(&b->depth, depth);
+}
+
+uint64_t
+report_count(struct report_buf* b)
+{
+    return atomic_load(&b->head);
+}
+
+uint64_t
+report_overruns(struct report_buf* b)
+{
+    return atomic_load(&b->overruns);
+}
+
+void
+report_close(struct report_buf* b)
+{
+    wp(pthread_mutex_lock(&b->mutex));
+    b->closed = 1;
+    wp(pthread_cond_broadcast(&b->cond));
+    wp(pthread_mutex_unlock(&b->mutex));
+}
+
+int
+report_closed(struct report_buf* b)
+{
+    wp(pthread_mutex_lock(&b->mutex));
+    int closed = b->closed;
+    wp(pthread_mutex_unlock(&b->mutex));
+    return closed;
+}
+
+void
+report_stall(struct report_buf* b, int stalled)
+{
+    wp(pthread_mutex_lock(&b->mutex));
+    b->stalled = stalled;
+    wp(pthread_cond_broadcast(&b->cond));
+    wp(pthread_mutex_unlock(&b->mutex));
+}
+
+int
+report_stalled(struct report_buf* b)
+{
+    wp(pthread_mutex_lock(&b->mutex));
+    int stalled = b->stalled;
+    wp(pthread_mutex_unlock(&b->mutex));
+    return stalled;
+}
+
+void
+report_wait(struct report_buf* b, int (*cancelled)())
+{
+    wp(pthread_mutex_lock(&b->mutex));
+    atomic_fetch_add(&b->waiters, 1);
+    // Anyone cancelling must call report_wakeup() after cancelled() is true.
+    if (!report_ready(b) && !b->closed && !b->stalled && !cancelled())
+        wp(pthread_cond_wait(&b->cond, &b->mutex));
+    atomic_fetch_sub(&b->waiters, 1);
+    wp(pthread_mutex_unlock(&b->mutex));
+}
@@ -0,0 +1,64 @@
+#ifndef BTSIXAD_REPORT_H
+#define BTSIXAD_REPORT_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Recent input reports of a device, written by a single producer without
+// locking and read by any number of consumers. By default only the latest
+// report is kept; a consumer can ask for up to REPORT_MAX_DEPTH.
+
+#define REPORT_MAX_DEPTH 128
+
+// When the report was received and processed, for latency statistics.
+struct report_stamp {
+    uint64_t received, processed;
+};
+
+struct report_slot {
+    atomic_uint_fast64_t seq; // odd while being written
+    size_t size;
+    struct report_stamp stamp;
+    unsigned char* data;
+};
+
+struct report_buf {
+    atomic_uint_fast64_t head; // number of reports put
+    atomic_uint_fast64_t tail; // number of reports consumed or skipped
+    atomic_int depth;
+    atomic_uint_fast64_t overruns; // skipped by consumers of a full queue
+    struct report_slot slots[REPORT_MAX_DEPTH];
+    unsigned char* data;
+    size_t max_size;
+    // only for blocking consumers; the producer takes the mutex only if
+    // someone is waiting
+    atomic_int waiters;
+    int closed;
+    int stalled; // blocking consumers give up until cleared
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+void report_init(struct report_buf* b, size_t max_size);
+void report_destroy(struct report_buf* b);
+void report_put(struct report_buf* b, const unsigned char* data, size_t size,
+                const struct report_stamp* stamp);
+int report_get(struct report_buf* b, unsigned char* data, size_t* size,
+               struct report_stamp* stamp);
+int report_ready(struct report_buf* b);
+uint64_t report_latest(struct report_buf* b, uint64_t since,
+                       unsigned char* data, size_t* size);
+void report_discard(struct report_buf* b);
+void report_set_depth(struct report_buf* b, int depth);
+uint64_t report_count(struct report_buf* b);
+uint64_t report_overruns(struct report_buf* b);
+void report_close(struct report_buf* b);
+int report_closed(struct report_buf* b);
+void report_stall(struct report_buf* b, int stalled);
+int report_stalled(struct report_buf* b);
+void report_wakeup(struct report_buf* b);
+void report_wait(struct report_buf* b, int (*cancelled)());
+
+#endif
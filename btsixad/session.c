@@ -0,0 +1,258 @@
+#include "session.h"
+
+#include "logger.h"
+#include "wrap.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/queue.h>
+
+
+// Sessions are kept in a hash table keyed by address, with a lock per bucket,
+// so connections from different devices don't contend. A session is created
+// when either channel is accepted and started when both are. Until then it
+// is on a list in order of deadline, since the timeout is fixed, and is
+// reaped if the other channel doesn't arrive in time.
+
+#define SESSION_BUCKETS 64
+
+struct session {
+    LIST_ENTRY(session) next;
+    TAILQ_ENTRY(session) half_open;
+    struct timespec deadline;
+    int waiting; // on the half-open list, under half_open_mutex
+    int started;
+    struct bucket* bucket;
+    struct device d;
+};
+
+static struct bucket {
+    pthread_mutex_t mutex;
+    LIST_HEAD(, session) sessions;
+} buckets[SESSION_BUCKETS];
+
+static const struct transport* transport;
+static int half_open_ms;
+static pthread_mutex_t half_open_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t half_open_cond;
+static TAILQ_HEAD(, session) half_open = TAILQ_HEAD_INITIALIZER(half_open);
+
+static atomic_uint_fast64_t open_sessions, started, duplicates, reaped;
+
+
+static struct bucket*
+bucket_of(const bdaddr_t* bdaddr)
+{
+    uint32_t h = 2166136261; // FNV-1a
+    for (int i = 0; i < sizeof bdaddr->b; i++)
+        h = (h ^ bdaddr->b[i]) * 16777619;
+    return &buckets[h % SESSION_BUCKETS];
+}
+
+static struct session*
+find(struct bucket* b, const bdaddr_t* bdaddr)
+{
+    struct session* s;
+    LIST_FOREACH(s, &b->sessions, next)
+        if (bdaddr_same(&s->d.bdaddr, bdaddr))
+            break;
+    return s;
+}
+
+static int
+expired(struct timespec* t)
+{
+    struct timespec now;
+    we(clock_gettime(CLOCK_MONOTONIC, &now));
+    return now.tv_sec > t->tv_sec ||
+           now.tv_sec == t->tv_sec && now.tv_nsec >= t->tv_nsec;
+}
+
+static void
+stop_waiting(struct session* s)
+{
+    wp(pthread_mutex_lock(&half_open_mutex));
+    if (s->waiting) {
+        TAILQ_REMOVE(&half_open, s, half_open);
+        s->waiting = 0;
+    }
+    wp(pthread_mutex_unlock(&half_open_mutex));
+}
+
+
+static void*
+session_run(void* s_void)
+{
+    struct session* s = s_void;
+    device_run(&s->d);
+    WR(close(s->d.intr));
+    WR(close(s->d.ctrl));
+    // TODO: is it possible and useful to wait for L2CAP close acknowledged?
+
+    wp(pthread_mutex_lock(&s->bucket->mutex));
+    LIST_REMOVE(s, next);
+    wp(pthread_mutex_unlock(&s->bucket->mutex));
+    atomic_fetch_sub(&open_sessions, 1);
+    char buf[32];
+    logger_printf(LOG_DEBUG, "connection from %s closed",
+                  bt_ntoa(&s->d.bdaddr, buf));
+    free(s);
+    return NULL;
+}
+
+void
+session_accept(const bdaddr_t* bdaddr, int ctrl, int fd)
+{
+    char buf[32];
+    logger_printf(LOG_DEBUG, "connection from %s on %s channel",
+                  bt_ntoa(bdaddr, buf), ctrl ? "control" : "interrupt");
+
+    struct bucket* b = bucket_of(bdaddr);
+    int duplicate = 0, start = 0;
+    wp(pthread_mutex_lock(&b->mutex));
+    struct session* s = find(b, bdaddr);
+    if (s && (ctrl ? s->d.ctrl : s->d.intr) != -1)
+        duplicate = 1;
+    else {
+        if (!s) {
+            s = wm(calloc(1, sizeof *s));
+            s->bucket = b;
+            wp(pthread_mutex_init(&s->d.mutex, NULL));
+            bdaddr_copy(&s->d.bdaddr, bdaddr);
+            s->d.intr = s->d.ctrl = -1;
+            s->d.transport = transport;
+            LIST_INSERT_HEAD(&b->sessions, s, next);
+            atomic_fetch_add(&open_sessions, 1);
+
+            we(clock_gettime(CLOCK_MONOTONIC, &s->deadline));
+            s->deadline.tv_sec += half_open_ms / 1000;
+            s->deadline.tv_nsec += half_open_ms % 1000 * 1000000L;
+            if (s->deadline.tv_nsec >= 1000000000L) {
+                s->deadline.tv_sec++;
+                s->deadline.tv_nsec -= 1000000000L;
+            }
+            wp(pthread_mutex_lock(&half_open_mutex));
+            if (TAILQ_EMPTY(&half_open))
+                wp(pthread_cond_signal(&half_open_cond));
+            TAILQ_INSERT_TAIL(&half_open, s, half_open);
+            s->waiting = 1;
+            wp(pthread_mutex_unlock(&half_open_mutex));
+        }
+        *(ctrl ? &s->d.ctrl : &s->d.intr) = fd;
+        if (s->d.ctrl != -1 && s->d.intr != -1) {
+            stop_waiting(s);
+            s->started = start = 1;
+            pthread_t thread;
+            wp(pthread_create(&thread, NULL, session_run, s));
+            wp(pthread_detach(thread));
+        }
+    }
+    wp(pthread_mutex_unlock(&b->mutex));
+
+    if (duplicate) {
+        atomic_fetch_add(&duplicates, 1);
+        WR(close(fd));
+    }
+    if (start)
+        atomic_fetch_add(&started, 1);
+}
+
+// The session may be gone or even replaced by the time its bucket is locked,
+// so it is looked up again by address.
+static void
+reap(const bdaddr_t* bdaddr)
+{
+    struct bucket* b = bucket_of(bdaddr);
+    wp(pthread_mutex_lock(&b->mutex));
+    struct session* s = find(b, bdaddr);
+    if (s && !s->started && expired(&s->deadline)) {
+        stop_waiting(s);
+        LIST_REMOVE(s, next);
+    } else
+        s = NULL;
+    wp(pthread_mutex_unlock(&b->mutex));
+
+    if (s) {
+        WR(close(s->d.ctrl != -1 ? s->d.ctrl : s->d.intr));
+        wp(pthread_mutex_destroy(&s->d.mutex));
+        free(s);
+        atomic_fetch_sub(&open_sessions, 1);
+        atomic_fetch_add(&reaped, 1);
+        char buf[32];
+        logger_printf(LOG_DEBUG, "connection from %s half-open, closed",
+                      bt_ntoa(bdaddr, buf));
+    }
+}
+
+static void*
+reaper_run(void* _)
+{
+    wp(pthread_mutex_lock(&half_open_mutex));
+    for (;;) {
+        struct session* s = TAILQ_FIRST(&half_open);
+        if (!s)
+            wp(pthread_cond_wait(&half_open_cond, &half_open_mutex));
+        else if (!expired(&s->deadline)) {
+            int r = pthread_cond_timedwait(&half_open_cond,
+                                           &half_open_mutex, &s->deadline);
+            if (r != ETIMEDOUT)
+                wp(r);
+        } else {
+            TAILQ_REMOVE(&half_open, s, half_open);
+            s->waiting = 0;
+            bdaddr_t bdaddr;
+            bdaddr_copy(&bdaddr, &s->d.bdaddr);
+            wp(pthread_mutex_unlock(&half_open_mutex));
+            reap(&bdaddr);
+            wp(pthread_mutex_lock(&half_open_mutex));
+        }
+    }
+}
+
+// transport is for all sessions, NULL for Bluetooth.
+void
+session_start(const struct transport* transport_, int half_open_ms_)
+{
+    transport = transport_;
+    half_open_ms = half_open_ms_;
+    for (int i = 0; i < SESSION_BUCKETS; i++) {
+        wp(pthread_mutex_init(&buckets[i].mutex, NULL));
+        LIST_INIT(&buckets[i].sessions);
+    }
+
+    pthread_condattr_t condattr;
+    wp(pthread_condattr_init(&condattr));
+    wp(pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC));
+    wp(pthread_cond_init(&half_open_cond, &condattr));
+    wp(pthread_condattr_destroy(&condattr));
+
+    pthread_t thread;
+    wp(pthread_create(&thread, NULL, reaper_run, NULL));
+    wp(pthread_detach(thread));
+}
+
+void
+session_foreach(void (*f)(struct device* d, void* arg), void* arg)
+{
+    for (int i = 0; i < SESSION_BUCKETS; i++) {
+        struct bucket* b = &buckets[i];
+        wp(pthread_mutex_lock(&b->mutex));
+        struct session* s;
+        LIST_FOREACH(s, &b->sessions, next)
+            if (s->started)
+                f(&s->d, arg);
+        wp(pthread_mutex_unlock(&b->mutex));
+    }
+}
+
+void
+session_stats(struct session_stats* stats)
+{
+    stats->open = atomic_load(&open_sessions);
+    stats->started = atomic_load(&started);
+    stats->duplicates = atomic_load(&duplicates);
+    stats->reaped = atomic_load(&reaped);
+}
@@ -0,0 +1,22 @@
+#ifndef BTSIXAD_SESSION_H
+#define BTSIXAD_SESSION_H
+
+#include "device.h"
+
+#include <stdint.h>
+
+// A device that has opened only one of its channels for this long is
+// disconnected.
+#define SESSION_HALF_OPEN_MS 10000
+
+struct session_stats {
+    uint64_t open; // including half-open
+    uint64_t started, duplicates, reaped;
+};
+
+void session_start(const struct transport* transport, int half_open_ms);
+void session_accept(const bdaddr_t* bdaddr, int ctrl, int fd);
+void session_foreach(void (*f)(struct device* d, void* arg), void* arg);
+void session_stats(struct session_stats* stats);
+
+#endif
@@ -0,0 +1,135 @@
+#include "shm.h"
+
+#include "btsixa_shm.h"
+#include "wrap.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// The latest report of each device with a unit number is copied to a slot of
+// a shared memory object that anyone may map read-only. Each slot is a
+// seqlock like those of the report buffer, but it is shared with clients
+// built by any compiler, so it uses plain integers with GCC atomic builtins.
+// Besides the channel thread putting reports, a slot is written when a device
+// takes it or leaves, so writers take the lock with a compare and swap; the
+// channel thread skips a report rather than wait.
+
+static struct btsixa_shm* shm; // NULL if not publishing
+static struct device* owners[BTSIXA_SHM_SLOTS];
+
+
+// Before daemon(), so that errors are seen.
+void
+shm_init(const char* name)
+{
+    // A previous instance may have left one with a different layout.
+    if (shm_unlink(name) == -1 && errno != ENOENT)
+        err(1, "%s", name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+        err(1, "%s", name);
+    we(ftruncate(fd, sizeof *shm));
+    void* p = mmap(NULL, sizeof *shm, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    if (p == MAP_FAILED)
+        err(1, "mmap() failed");
+    we(close(fd));
+    shm = p;
+}
+
+// After daemon(), which changes the pid.
+void
+shm_start()
+{
+    if (!shm)
+        return;
+    shm->version = BTSIXA_SHM_VERSION;
+    shm->n_slots = BTSIXA_SHM_SLOTS;
+    shm->pid = getpid();
+    __atomic_store_n(&shm->magic, BTSIXA_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+static struct btsixa_shm_slot*
+slot_of(struct device* d)
+{
+    if (!shm || d->unit < 0 || d->unit >= BTSIXA_SHM_SLOTS)
+        return NULL;
+    return &shm->slots[d->unit];
+}
+
+static int
+lock(struct btsixa_shm_slot* slot)
+{
+    uint32_t seq = __atomic_load_n(&slot->lock, __ATOMIC_RELAXED);
+    if (seq & 1 || !__atomic_compare_exchange_n(&slot->lock, &seq, seq+1,
+                                                 0, __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+        return 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+static void
+unlock(struct btsixa_shm_slot* slot)
+{
+    __atomic_add_fetch(&slot->lock, 1, __ATOMIC_RELEASE);
+}
+
+static void
+set_owner(struct device* d, struct device* owner)
+{
+    struct btsixa_shm_slot* slot = slot_of(d);
+    if (!slot)
+        return;
+    while (!lock(slot))
+        ;
+    owners[d->unit] = owner;
+    slot->size = 0;
+    slot->seq = 0;
+    slot->received = 0;
+    unlock(slot);
+}
+
+// Units are not reused while attached.
+void
+shm_attach(struct device* d)
+{
+    set_owner(d, d);
+}
+
+void
+shm_detach(struct device* d)
+{
+    set_owner(d, NULL);
+}
+
+// After fixing up, whether or not the report is delivered to readers.
+void
+shm_publish(struct device* d, const unsigned char* data, size_t size,
+            uint64_t received)
+{
+    struct btsixa_shm_slot* slot = slot_of(d);
+    if (!slot || !size || !lock(slot))
+        return;
+    if (owners[d->unit] == d) {
+        if (!received) {
+            struct timespec t;
+            we(clock_gettime(CLOCK_MONOTONIC, &t));
+            received = (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+        }
+        if (size > BTSIXA_SHM_REPORT_SIZE)
+            size = BTSIXA_SHM_REPORT_SIZE;
+        memcpy(slot->report, data, size);
+        slot->size = size;
+        slot->seq++;
+        slot->received = received;
+    }
+    unlock(slot);
+}
@@ -0,0 +1,13 @@
+#ifndef BTSIXAD_SHM_H
+#define BTSIXAD_SHM_H
+
+#include "device.h"
+
+void shm_init(const char* name);
+void shm_start();
+void shm_attach(struct device* d);
+void shm_detach(struct device* d);
+void shm_publish(struct device* d, const unsigned char* data, size_t size,
+                 uint64_t received);
+
+#endif
@@ -1,5 +1,10 @@
 #include "sixaxis.h"
 
+#include "host.h"
+#include "wrap.h"
+
+#include <pthread.h>
+#include <stdint.h>
 #include <dev/usb/usbhid.h>
 
 
@@ -101,21 +106,136 @@ static unsigned char descr[] = {
     0xc0              // End Collection
 };
 
-struct descr sixaxis_descr = { descr, sizeof descr, 1 };
+// device information and pairing address
+static const unsigned char static_features[] = { 0xf2, 0xf5 };
 
+// ID, buttons, hat, sticks, L2 and R2; accelerometers and gyro follow at 41
+static const unsigned char exact_mask[49] = {
+    [0] = 0xff, [1] = 0xff, [2] = 0xff, [3] = 0xff, [4] = 0xff, [5] = 0xff,
+    [6] = 0xff, [7] = 0xff, [8] = 0xff, [9] = 0xff, [18] = 0xff, [19] = 0xff
+};
 
-void
+// original and reshuffled buttons, and the hat
+static const unsigned char button_mask[49] = {
+    [2] = 0xff, [3] = 0xff, [4] = 0xff, [5] = 0xff
+};
+
+// Output reports are written with all 48 bytes declared, of which rumble and
+// the LEDs set in sixaxis_leds take the first 35.
+struct descr sixaxis_descr = { descr, sizeof descr, 1, 49,
+                               static_features, sizeof static_features,
+                               exact_mask, { 41, 4 }, 49, button_mask };
+
+
+// The Navigation controller sends the same report with the buttons it lacks
+// left unset, so it is reshuffled the same way and described with only X,
+// Circle, L1, L3 and PS, in that order, the D-pad, the stick and L2.
+
+static unsigned char navigation_descr_data[] = {
+    0x05, 0x01,       // Usage Page - Generic Desktop
+    0x09, 0x05,       // Usage - Gamepad
+    0xa1, 0x01,       // Collection - Application
+    0x85, 0x01,       //     Report ID - 1
+
+    0x14,             //     Logical Minimum - 0
+    0x25, 0x01,       //     Logical Maximum - 1
+    0x75, 0x01,       //     Report Size - 1
+    0x95, 0x15,       //     Report Count - 21
+    0x81, 0x01,       //     Input (Const, Array, Absolute) [padding]
+                      //     - as for the Sixaxis, and Square
+    0x05, 0x09,       //     Usage Page - Button
+    0x19, 0x01,       //     Usage Mimumum - Button 1
+    0x29, 0x02,       //     Usage Maximum - Button 2
+    0x95, 0x02,       //     Report Count - 2
+    0x81, 0x02,       //     Input (Data, Variable, Absolute)
+                      //     - X, Circle
+    0x95, 0x06,       //     Report Count - 6
+    0x81, 0x01,       //     Input (Const, Array, Absolute) [padding]
+                      //     - Triangle, as for the Sixaxis, and R1
+    0x09, 0x03,       //     Usage - Button 3
+    0x95, 0x01,       //     Report Count - 1
+    0x81, 0x02,       //     Input (Data, Variable, Absolute)
+                      //     - L1
+    0x81, 0x01,       //     Input (Const, Array, Absolute) [padding]
+                      //     - R3
+    0x09, 0x04,       //     Usage - Button 4
+    0x81, 0x02,       //     Input (Data, Variable, Absolute)
+                      //     - L3
+    0x95, 0x02,       //     Report Count - 2
+    0x81, 0x01,       //     Input (Const, Array, Absolute) [padding]
+                      //     - Start, Select
+    0x09, 0x05,       //     Usage - Button 5
+    0x95, 0x01,       //     Report Count - 1
+    0x81, 0x02,       //     Input (Data, Variable, Absolute)
+                      //     - PS
+    0x81, 0x01,       //     Input (Const, Array, Absolute) [padding]
+
+    0x05, 0x01,       //     Usage Page - Generic Desktop
+    0x09, 0x39,       //     Usage - Hat switch
+    0x14,             //     Logical Minimum - 0
+    0x25, 0x07,       //     Logical Maximum - 7
+    0x34,             //     Physical Minimum - 0
+    0x46, 0x3b, 0x01, //     Physical Maximum - 315
+    0x65, 0x14,       //     Unit - Degrees
+    0x75, 0x04,       //     Report Size - 4
+    0x81, 0x42,       //     Input (Data, Variable, Absolute, Null State)
+                      //     - converted D-pad
+    0x64,             //     Unit - None
+
+    0x09, 0x01,       //     Usage - Pointer
+    0xa1, 0x00,       //     Collection - Physical
+    0x09, 0x30,       //         Usage - X
+    0x09, 0x31,       //         Usage - Y
+    0x26, 0xff, 0x00, //         Logical Maximum - 255
+    0x35, 0x80,       //         Physical Minimum - -128
+    0x45, 0x7f,       //         Physical Maximum - 127
+    0x75, 0x08,       //         Report Size - 8
+    0x95, 0x02,       //         Report Count - 2
+    0x81, 0x02,       //         Input (Data, Variable, Absolute)
+    0xc0,             //     End Collection
+
+    0x95, 0x0a,       //     Report Count - 10
+    0x81, 0x01,       //     Input (Const, Array, Absolute) [padding]
+    0x09, 0x36,       //     Usage - Slider
+    0x34,             //     Physical Minimum - 0
+    0x46, 0xff, 0x00, //     Physical Maximum - 255
+    0x95, 0x01,       //     Report Count - 1
+    0x81, 0x02,       //     Input (Data, Variable, Absolute)
+                      //     - L2
+    0x44,             //     Physical Maximum - 0
+    0x95, 0x1e,       //     Report Count - 30
+    0x81, 0x01,       //     Input (Const, Array, Absolute) [padding]
+    0x95, 0x30,       //     Report Count - 48
+    0x91, 0x02,       //     Output (Data, Variable, Absolute)
+    0xb1, 0x02,       //     Feature (Data, Variable, Absolute)
+    0xc0              // End Collection
+};
+
+// ID, buttons, hat, stick and L2; there are no motion sensors
+static const unsigned char navigation_exact_mask[49] = {
+    [0] = 0xff, [1] = 0xff, [2] = 0xff, [3] = 0xff, [4] = 0xff, [5] = 0xff,
+    [6] = 0xff, [7] = 0xff, [18] = 0xff
+};
+
+static struct descr navigation_descr = {
+    navigation_descr_data, sizeof navigation_descr_data, 1, 49,
+    static_features, sizeof static_features, navigation_exact_mask, { 0, 0 },
+    49, button_mask
+};
+
+
+static void
 sixaxis_operational(struct device* d, int operational)
 {
     // magic
     unsigned char report[] =
         { 0xf4, 0x42, operational < 0 ? 8 : operational ? 3 : 1, 0, 0 };
-    device_set_report(d, UHID_FEATURE_REPORT, report, sizeof report);
+    device_set_report_async(d, UHID_FEATURE_REPORT, report, sizeof report);
 }
 
 
-void
-sixaxis_leds(struct device* d, int bitmap, int blink)
+static void
+sixaxis_send_leds(struct device* d, int bitmap, int blink)
 {
     // Each LED timer is controlled by 5 bytes:
     // - duration in 20 ms increments (0 = off, 0xff = forever)
@@ -127,7 +247,7 @@ sixaxis_leds(struct device* d, int bitmap, int blink)
     report[10] = bitmap << 1;
     if (blink)
         // sync all timers by switching them off
-        device_set_report(d, UHID_OUTPUT_REPORT, report, sizeof report);
+        device_set_report_async(d, UHID_OUTPUT_REPORT, report, sizeof report);
     for (int i = 0; i < 4; i++)
         if (bitmap & 1 << i) {
             unsigned char* timer = report+(26-5*i);
@@ -140,29 +260,165 @@ sixaxis_leds(struct device* d, int bitmap, int blink)
             } else
                 timer[4] = timer[1] = 0x80; // continuously on
         }
-    device_set_report(d, UHID_OUTPUT_REPORT, report, sizeof report);
+    device_set_report_async(d, UHID_OUTPUT_REPORT, report, sizeof report);
+}
+
+// LED states are set one at a time by whichever thread comes first, and a
+// state that comes meanwhile replaces any other not set yet. Repeating the
+// current state would restart blinking, so it is skipped.
+static void
+sixaxis_leds(struct device* d, int bitmap, int blink)
+{
+    wp(pthread_mutex_lock(&d->mutex));
+    d->leds_wanted = bitmap | blink << 4;
+    if (!d->leds_setting) {
+        d->leds_setting = 1;
+        while (d->leds != d->leds_wanted) {
+            int state = d->leds = d->leds_wanted;
+            wp(pthread_mutex_unlock(&d->mutex));
+            sixaxis_send_leds(d, state & 0xf, state >> 4);
+            wp(pthread_mutex_lock(&d->mutex));
+        }
+        d->leds_setting = 0;
+    }
+    wp(pthread_mutex_unlock(&d->mutex));
 }
 
 
 static char hat[] = { 15, 0, 2, 1, 4, 15, 3, 15, 6, 7, 15, 15, 5, 15, 15, 15 };
 
+// Bytes 3 to 5 of the report in terms of bytes 2 to 4. Each result bit depends
+// on a single source byte, so this is also used to build the tables below.
 void
-sixaxis_fixup(struct device* d, int kind, unsigned char* data, size_t size)
+sixaxis_reshuffle(unsigned char* data)
+{
+    data[3] = data[3] & 0xf |       // lower nibble
+              data[3] >> 3 & 0x10 | // Square
+              data[3] >> 1 & 0x20 | // X
+              data[3] << 1 & 0x40 | // O
+              data[3] << 3 & 0x80;  // Triangle
+    data[4] = data[4] & 0xf |       // lower nibble
+              data[3] << 1 & 0x10 | // R1
+              data[3] << 3 & 0x20 | // L1
+              data[2] << 4 & 0x40 | // R3
+              data[2] << 6 & 0x80;  // L3
+    data[5] = data[2] >> 3 & 1 |            // Start
+              data[2] << 1 & 2 |            // Select
+              data[4] << 2 & 4 |            // PS
+              hat[data[2] >> 4 & 0xf] << 4; // D-pad
+}
+
+// Bytes 3 to 5 for each value of one of bytes 2 to 4, XOR the result for all
+// zeros (which isn't zero because of the hat), so the tables for the three
+// bytes can be XORed together. The result for all zeros is folded into the
+// first table.
+static uint32_t reshuffle[3][256];
+
+static uint32_t
+reshuffle_one(int i, int v)
+{
+    unsigned char data[6] = {};
+    data[2+i] = v;
+    sixaxis_reshuffle(data);
+    return data[3] | data[4] << 8 | data[5] << 16;
+}
+
+void
+sixaxis_init()
+{
+    uint32_t zero = reshuffle_one(0, 0);
+    for (int i = 0; i < 3; i++)
+        for (int v = 0; v < 256; v++)
+            reshuffle[i][v] = reshuffle_one(i, v) ^ (i ? zero : 0);
+}
+
+// From the interrupt channel, where all reports are input reports.
+static size_t
+sixaxis_input(struct device* d, unsigned char* data, size_t size)
 {
-    if (kind == UHID_INPUT_REPORT && size == 49 && data[0] == 1) {
-        data[3] = data[3] & 0xf |       // lower nibble
-                  data[3] >> 3 & 0x10 | // Square
-                  data[3] >> 1 & 0x20 | // X
-                  data[3] << 1 & 0x40 | // O
-                  data[3] << 3 & 0x80;  // Triangle
-        data[4] = data[4] & 0xf |       // lower nibble
-                  data[3] << 1 & 0x10 | // R1
-                  data[3] << 3 & 0x20 | // L1
-                  data[2] << 4 & 0x40 | // R3
-                  data[2] << 6 & 0x80;  // L3
-        data[5] = data[2] >> 3 & 1 |            // Start
-                  data[2] << 1 & 2 |            // Select
-                  data[4] << 2 & 4 |            // PS
-                  hat[data[2] >> 4 & 0xf] << 4; // D-pad
+    if (size == 49 && data[0] == 1) {
+        uint32_t r = reshuffle[0][data[2]] ^ reshuffle[1][data[3]] ^
+                     reshuffle[2][data[4]];
+        data[3] = r;
+        data[4] = r >> 8;
+        data[5] = r >> 16;
     }
+    return size;
+}
+
+void
+sixaxis_fixup(struct device* d, int kind, unsigned char* data, size_t size)
+{
+    if (kind == UHID_INPUT_REPORT)
+        sixaxis_input(d, data, size);
+}
+
+
+static void
+sixaxis_open(struct device* d)
+{
+    sixaxis_operational(d, 1);
+}
+
+static void
+sixaxis_close(struct device* d)
+{
+    sixaxis_operational(d, dflag > 2);
+}
+
+static void
+sixaxis_timeout(struct device* d)
+{
+    sixaxis_operational(d, -1);
+}
+
+// Bytes 2 and 4 are durations, which are left to the daemon.
+static void
+sixaxis_rumble(unsigned char* report, int weak, int strong)
+{
+    report[2] = weak ? 0xff : 0;
+    report[3] = weak != 0;
+    report[4] = strong ? 0xff : 0;
+    report[5] = strong;
 }
+
+static struct descr*
+sixaxis_get_descr(struct device* d)
+{
+    return &sixaxis_descr;
+}
+
+static void
+sixaxis_unit_leds(struct device* d, int opened)
+{
+    if (d->unit >= 0)
+        // uhid1 is LED 1
+        sixaxis_leds(d, 1 << d->unit % 4, !opened);
+    else
+        sixaxis_leds(d, 0xf, 1);
+}
+
+const struct driver sixaxis_driver = {
+    "Sixaxis gamepad", sixaxis_get_descr, sixaxis_input, sixaxis_fixup,
+    sixaxis_unit_leds, sixaxis_open, sixaxis_close, sixaxis_timeout,
+    sixaxis_rumble, NULL, 0, 1
+};
+
+static struct descr*
+navigation_get_descr(struct device* d)
+{
+    return &navigation_descr;
+}
+
+// There is only one LED, which can't show the unit.
+static void
+navigation_leds(struct device* d, int opened)
+{
+    sixaxis_leds(d, 1, d->unit < 0 || !opened);
+}
+
+const struct driver navigation_driver = {
+    "Navigation controller", navigation_get_descr, sixaxis_input,
+    sixaxis_fixup, navigation_leds, sixaxis_open, sixaxis_close,
+    sixaxis_timeout, NULL, NULL, 0, 1
+};
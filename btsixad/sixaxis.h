@@ -4,10 +4,12 @@
 #include "device.h"
 
 extern struct descr sixaxis_descr;
+extern const struct driver sixaxis_driver;
+extern const struct driver navigation_driver;
 
-void sixaxis_operational(struct device* d, int operational);
-void sixaxis_leds(struct device* d, int bitmap, int blink);
+void sixaxis_init();
 void sixaxis_fixup(struct device* d, int kind,
                    unsigned char* data, size_t size);
+void sixaxis_reshuffle(unsigned char* data);
 
 #endif
@@ -0,0 +1,226 @@
+#include "timer.h"
+
+#include "wrap.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+
+// Timers are kept in slots of millisecond ticks, each level of the wheel 64
+// times coarser than the one below. A timer goes to the lowest level whose
+// span covers it and moves down a level each time the wheel turns to its
+// slot, so setting and unsetting takes constant time however many there are.
+// Those beyond the top level are put back until they are in reach. The
+// thread sleeps until the next slot that has timers, not every tick.
+
+#define TIMER_TICK 1000000 // ns
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+LIST_HEAD(timer_list, timer);
+
+static const clockid_t timed_clock = CLOCK_MONOTONIC;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond; // for the thread, on timed_clock
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static struct timer_list wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t occupied[TIMER_LEVELS]; // slots that have timers
+static struct timer_list expired = LIST_HEAD_INITIALIZER(expired);
+static uint64_t tick; // the last one processed
+static uint64_t planned; // tick the thread sleeps until, 0 if awake
+static struct timer* running;
+static int draining;
+
+
+static uint64_t
+clock_now()
+{
+    struct timespec t;
+    we(clock_gettime(timed_clock, &t));
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// With the mutex held, as for all of these.
+static void
+insert(struct timer* t)
+{
+    if (t->due <= tick) {
+        t->level = -1;
+        LIST_INSERT_HEAD(&expired, t, next);
+        return;
+    }
+    uint64_t delta = t->due - tick;
+    int level = 0;
+    while (level < TIMER_LEVELS-1 && delta >> TIMER_BITS*(level+1))
+        level++;
+    int slot = t->due >> TIMER_BITS*level & (TIMER_SLOTS-1);
+    t->level = level;
+    t->slot = slot;
+    LIST_INSERT_HEAD(&wheel[level][slot], t, next);
+    occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void
+detach(struct timer* t)
+{
+    LIST_REMOVE(t, next);
+    if (t->level >= 0 && LIST_EMPTY(&wheel[t->level][t->slot]))
+        occupied[t->level] &= ~((uint64_t)1 << t->slot);
+}
+
+// Put the timers of a slot back in the wheel, which is now at its tick.
+static void
+cascade(int level, int slot)
+{
+    struct timer_list list = LIST_HEAD_INITIALIZER(list);
+    struct timer* t;
+    while ((t = LIST_FIRST(&wheel[level][slot]))) {
+        detach(t);
+        LIST_INSERT_HEAD(&list, t, next);
+    }
+    while ((t = LIST_FIRST(&list))) {
+        LIST_REMOVE(t, next);
+        insert(t);
+    }
+}
+
+// The next tick at which a slot is processed, 0 if there are none.
+static uint64_t
+next_tick()
+{
+    uint64_t next = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        int shift = TIMER_BITS*level;
+        uint64_t turn = (uint64_t)1 << (shift + TIMER_BITS);
+        uint64_t base = tick & ~(turn - 1);
+        for (uint64_t bits = occupied[level]; bits; bits &= bits - 1) {
+            uint64_t at = base + ((uint64_t)__builtin_ctzll(bits) << shift);
+            if (at <= tick)
+                at += turn;
+            if (!next || at < next)
+                next = at;
+        }
+    }
+    return next;
+}
+
+// Go from slot to slot that has timers, not tick by tick, which would take
+// millions of steps to reach a timeout an hour away.
+static void
+advance(uint64_t to)
+{
+    for (;;) {
+        uint64_t next = next_tick();
+        if (!next || next > to)
+            break;
+        tick = next;
+        for (int level = TIMER_LEVELS-1; level >= 0; level--)
+            if (!(tick & (((uint64_t)1 << TIMER_BITS*level) - 1)))
+                cascade(level, tick >> TIMER_BITS*level & (TIMER_SLOTS-1));
+    }
+    if (tick < to)
+        tick = to;
+}
+
+static void*
+timer_run(void* _)
+{
+    wp(pthread_mutex_lock(&mutex));
+    for (;;) {
+        advance(clock_now() / TIMER_TICK);
+        struct timer* t = LIST_FIRST(&expired);
+        if (t) {
+            LIST_REMOVE(t, next);
+            t->pending = 0;
+            running = t;
+            wp(pthread_mutex_unlock(&mutex));
+            t->fire(t->arg);
+            wp(pthread_mutex_lock(&mutex));
+            running = NULL;
+            if (draining)
+                wp(pthread_cond_broadcast(&drained));
+            continue;
+        }
+        uint64_t next = next_tick();
+        planned = next ? next : UINT64_MAX;
+        if (next) {
+            uint64_t ns = next * TIMER_TICK;
+            struct timespec t = { ns / 1000000000, ns % 1000000000 };
+            int r = pthread_cond_timedwait(&cond, &mutex, &t);
+            if (r != ETIMEDOUT)
+                wp(r);
+        } else
+            wp(pthread_cond_wait(&cond, &mutex));
+        planned = 0;
+    }
+}
+
+void
+timer_start()
+{
+    pthread_condattr_t condattr;
+    wp(pthread_condattr_init(&condattr));
+    wp(pthread_condattr_setclock(&condattr, timed_clock));
+    wp(pthread_cond_init(&cond, &condattr));
+    wp(pthread_condattr_destroy(&condattr));
+
+    tick = clock_now() / TIMER_TICK;
+    pthread_t thread;
+    wp(pthread_create(&thread, NULL, timer_run, NULL));
+    wp(pthread_detach(thread));
+}
+
+void
+timer_init(struct timer* t, void (*fire)(void* arg), void* arg)
+{
+    t->fire = fire;
+    t->arg = arg;
+    t->pending = 0;
+}
+
+// Replaces the deadline if already set.
+void
+timer_set(struct timer* t, uint64_t due)
+{
+    wp(pthread_mutex_lock(&mutex));
+    if (t->pending)
+        detach(t);
+    t->due = (due + TIMER_TICK - 1) / TIMER_TICK; // never early
+    t->pending = 1;
+    insert(t);
+    if (t->due < planned)
+        wp(pthread_cond_signal(&cond));
+    wp(pthread_mutex_unlock(&mutex));
+}
+
+// The function may still be running.
+void
+timer_unset(struct timer* t)
+{
+    wp(pthread_mutex_lock(&mutex));
+    if (t->pending) {
+        detach(t);
+        t->pending = 0;
+    }
+    wp(pthread_mutex_unlock(&mutex));
+}
+
+// Unset and wait until the function has returned, so that what it uses can be
+// freed. Not to be called with anything held that it takes.
+void
+timer_drain(struct timer* t)
+{
+    wp(pthread_mutex_lock(&mutex));
+    draining++;
+    while (running == t)
+        wp(pthread_cond_wait(&drained, &mutex));
+    draining--;
+    if (t->pending) { // perhaps set again by the function
+        detach(t);
+        t->pending = 0;
+    }
+    wp(pthread_mutex_unlock(&mutex));
+}
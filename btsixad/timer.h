@@ -0,0 +1,26 @@
+#ifndef BTSIXAD_TIMER_H
+#define BTSIXAD_TIMER_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+// Deadlines of all devices, kept by one thread in a hierarchical timer wheel
+// so that device threads wait without timeouts. When its deadline, in
+// CLOCK_MONOTONIC nanoseconds, has passed, a timer's function is called on
+// that thread, and should only wake up whoever set the timer.
+struct timer {
+    void (*fire)(void* arg);
+    void* arg;
+    // private:
+    LIST_ENTRY(timer) next;
+    uint64_t due; // tick
+    int pending, level, slot; // level -1 when due
+};
+
+void timer_start();
+void timer_init(struct timer* t, void (*fire)(void* arg), void* arg);
+void timer_set(struct timer* t, uint64_t due);
+void timer_unset(struct timer* t);
+void timer_drain(struct timer* t);
+
+#endif
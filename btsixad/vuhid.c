@@ -1,17 +1,25 @@
 #include "vuhid.h"
 
+#include "btsixa.h"
 #include "device.h"
 #include "host.h"
+#include "logger.h"
+#include "mux.h"
+#include "pool.h"
+#include "shm.h"
 #include "wrap.h"
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <sys/queue.h>
 #include <dev/usb/usb_ioctl.h>
 
 #include <cuse.h>
@@ -21,20 +29,33 @@
 #endif
 
 
+// cuse has no way to complete a request later, so one that blocks, e.g. a
+// read waiting for a report or GET_REPORT waiting for the gamepad, holds its
+// worker. The pool grows so that another worker is always waiting for new
+// requests, and shrinks back as requests finish. Only requests that may block
+// are counted, so quick ones don't make it grow: opening and closing, which
+// set the LEDs, blocking reads, writes sent at once, and GET_REPORT and
+// SET_REPORT.
+
+static struct pool workers = { cuse_wait_and_process, 4, 256 };
+
 static int
 v_open(struct cuse_dev* dev, int fflags)
 {
     struct device* d = cuse_dev_get_priv0(dev);
-    if (!device_open(d))
-        return CUSE_ERR_BUSY;
-    return CUSE_ERR_NONE;
+    pool_enter(&workers);
+    int r = device_open(d);
+    pool_leave(&workers);
+    return r ? CUSE_ERR_NONE : CUSE_ERR_BUSY;
 }
 
 static int
 v_close(struct cuse_dev* dev, int fflags)
 {
     struct device* d = cuse_dev_get_priv0(dev);
+    pool_enter(&workers);
     device_close(d);
+    pool_leave(&workers);
     return CUSE_ERR_NONE;
 }
 
@@ -44,15 +65,23 @@ v_read(struct cuse_dev* dev, int fflags, void* peer_ptr, int len_)
     if (!(fflags & CUSE_FFLAG_READ))
         return CUSE_ERR_OTHER;
     struct device* d = cuse_dev_get_priv0(dev);
+    unsigned char buf[DEVICE_MAX_REPORT_SIZE];
     size_t len = len_;
-    if (len > DEVICE_MAX_REPORT_SIZE)
-        len = DEVICE_MAX_REPORT_SIZE;
-    unsigned char* buf = wm(malloc(len));
+    if (len > sizeof buf)
+        len = sizeof buf;
     int nonblock = fflags & CUSE_FFLAG_NONBLOCK;
-    if (!device_read(d, nonblock, buf, &len))
+    if (!nonblock)
+        pool_enter(&workers);
+    int r = device_read(d, nonblock, buf, &len);
+    if (!nonblock)
+        pool_leave(&workers);
+    if (r == -1)
+        return CUSE_ERR_OTHER; // stalled
+    if (!r)
         len = 0; // disconnected, act like EOF
-    int r = cuse_copy_out(buf, peer_ptr, len);
-    free(buf);
+    r = cuse_copy_out(buf, peer_ptr, len);
+    if (len)
+        device_read_copied(d);
     if (!r && nonblock && !len)
         r = CUSE_ERR_WOULDBLOCK;
     return r ? r : len;
@@ -64,14 +93,18 @@ v_write(struct cuse_dev* dev, int fflags, const void* peer_ptr, int len_)
     if (!(fflags & CUSE_FFLAG_WRITE))
         return CUSE_ERR_OTHER;
     struct device* d = cuse_dev_get_priv0(dev);
+    unsigned char buf[DEVICE_MAX_REPORT_SIZE];
     size_t len = len_;
-    if (len > DEVICE_MAX_REPORT_SIZE)
-        len = DEVICE_MAX_REPORT_SIZE;
-    unsigned char* buf = wm(malloc(len));
+    if (len > sizeof buf)
+        len = sizeof buf;
     int r = cuse_copy_in(peer_ptr, buf, len);
+    // With a rate, writes only go to the shadow.
+    if (!output_rate)
+        pool_enter(&workers);
     if (!r && !device_write(d, buf, len))
         r = CUSE_ERR_INVALID;
-    free(buf);
+    if (!output_rate)
+        pool_leave(&workers);
     return r ? r : len;
 }
 
@@ -93,7 +126,7 @@ v_ioctl(struct cuse_dev* dev, int fflags, unsigned long cmd,
     struct device* d = cuse_dev_get_priv0(dev);
     struct usb_gen_descriptor m, *p = peer_data;
     int r = CUSE_ERR_INVALID;
-    unsigned char* buf = NULL;
+    unsigned char buf[DEVICE_MAX_REPORT_SIZE];
     switch (cmd) {
     case USB_GET_REPORT_ID: {
         int id = d->descr->id;
@@ -113,6 +146,62 @@ v_ioctl(struct cuse_dev* dev, int fflags, unsigned long cmd,
             r = cuse_copy_out(d->descr->report.data, m.ugd_data, m.ugd_maxlen);
         }
         break;
+    case BTSIXA_SET_QUEUE: {
+        int depth;
+        if (r = cuse_copy_in(peer_data, &depth, sizeof depth))
+            break;
+        if (depth < 1 || depth > REPORT_MAX_DEPTH)
+            return CUSE_ERR_INVALID;
+        device_set_queue(d, depth);
+        break;
+    }
+    case BTSIXA_SET_CACHE: {
+        int cache;
+        if (r = cuse_copy_in(peer_data, &cache, sizeof cache))
+            break;
+        device_set_cache(d, !!cache);
+        break;
+    }
+    case BTSIXA_SET_THRESHOLD: {
+        int threshold;
+        if (r = cuse_copy_in(peer_data, &threshold, sizeof threshold))
+            break;
+        if (threshold < -1)
+            return CUSE_ERR_INVALID;
+        device_set_threshold(d, threshold);
+        break;
+    }
+    case BTSIXA_SET_RATE: {
+        int rate;
+        if (r = cuse_copy_in(peer_data, &rate, sizeof rate))
+            break;
+        if (rate < 0)
+            return CUSE_ERR_INVALID;
+        device_set_rate(d, rate);
+        break;
+    }
+    case BTSIXA_PLAY_EFFECT: {
+        if (!(fflags & CUSE_FFLAG_WRITE))
+            return CUSE_ERR_OTHER;
+        struct btsixa_effect e;
+        if (r = cuse_copy_in(peer_data, &e, sizeof e))
+            break;
+        if (!device_play_effect(d, &e))
+            return CUSE_ERR_INVALID;
+        break;
+    }
+    case BTSIXA_GET_STATS: {
+        struct btsixa_stats stats;
+        device_stats(d, &stats);
+        r = cuse_copy_out(&stats, peer_data, sizeof stats);
+        break;
+    }
+    case BTSIXA_GET_STATUS: {
+        struct btsixa_status status;
+        device_status(d, &status);
+        r = cuse_copy_out(&status, peer_data, sizeof status);
+        break;
+    }
     case USB_GET_REPORT:
     case USB_SET_REPORT: {
         if (!(fflags & (cmd == USB_GET_REPORT ? CUSE_FFLAG_READ
@@ -124,25 +213,28 @@ v_ioctl(struct cuse_dev* dev, int fflags, unsigned long cmd,
         if (!(kind >= 1 && kind <= 3))
             return CUSE_ERR_INVALID;
         size_t len = m.ugd_maxlen;
-        if (len > DEVICE_MAX_REPORT_SIZE)
-            len = DEVICE_MAX_REPORT_SIZE;
-        buf = wm(malloc(len));
+        if (len > sizeof buf)
+            len = sizeof buf;
         if (cmd == USB_GET_REPORT) {
             if (d->descr->id && len)
                 if (r = cuse_copy_in(m.ugd_data, buf, 1))
                     break;
-            if (r = bthid_result(device_get_report(d, kind, buf, &len)))
+            pool_enter(&workers);
+            r = bthid_result(device_get_report(d, kind, buf, &len));
+            pool_leave(&workers);
+            if (r)
                 break;
             r = cuse_copy_out(buf, m.ugd_data, len);
         } else {
             if (r = cuse_copy_in(m.ugd_data, buf, len))
                 break;
+            pool_enter(&workers);
             r = bthid_result(device_set_report(d, kind, buf, len));
+            pool_leave(&workers);
         }
         break;
     }
     }
-    free(buf);
     return r;
 }
 
@@ -161,8 +253,67 @@ v_poll(struct cuse_dev* dev, int fflags, int events)
     return revents;
 }
 
+
+// The aggregate node takes reads and polls, and is busy while open like the
+// device nodes.
+
+static int
+m_open(struct cuse_dev* dev, int fflags)
+{
+    pool_enter(&workers);
+    int r = mux_open();
+    pool_leave(&workers);
+    return r ? CUSE_ERR_NONE : CUSE_ERR_BUSY;
+}
+
+static int
+m_close(struct cuse_dev* dev, int fflags)
+{
+    pool_enter(&workers);
+    mux_close();
+    pool_leave(&workers);
+    return CUSE_ERR_NONE;
+}
+
+static int
+m_read(struct cuse_dev* dev, int fflags, void* peer_ptr, int len_)
+{
+    if (!(fflags & CUSE_FFLAG_READ))
+        return CUSE_ERR_OTHER;
+    unsigned char buf[4096];
+    size_t len = len_;
+    if (len > sizeof buf)
+        len = sizeof buf;
+    if (len < sizeof(struct btsixa_mux_record))
+        return CUSE_ERR_INVALID;
+    int nonblock = fflags & CUSE_FFLAG_NONBLOCK;
+    if (!nonblock)
+        pool_enter(&workers);
+    int ok = mux_read(nonblock, buf, &len);
+    if (!nonblock)
+        pool_leave(&workers);
+    if (!ok)
+        return CUSE_ERR_SIGNAL;
+    int r = cuse_copy_out(buf, peer_ptr, len);
+    if (!r && nonblock && !len)
+        r = CUSE_ERR_WOULDBLOCK;
+    return r ? r : len;
+}
+
+static int
+m_poll(struct cuse_dev* dev, int fflags, int events)
+{
+    int revents = 0;
+    if (events & CUSE_POLL_READ && mux_ready())
+        revents |= CUSE_POLL_READ;
+    return revents;
+}
+
+
 static struct cuse_methods v_methods =
     { v_open, v_close, v_read, v_write, v_ioctl, v_poll };
+static struct cuse_methods m_methods =
+    { m_open, m_close, m_read, NULL, NULL, m_poll };
 
 
 static int initialized;
@@ -197,25 +348,51 @@ vuhid_init()
             error = "cuse_init() failed";
         }
         if (dflag)
-            syslog(LOG_WARNING, "%s, won't create %s device", error, name);
+            logger_printf(LOG_WARNING, "%s, won't create %s device",
+                          error, name);
         else
             errx(1, "%s", error);
     }
 }
 
+// A peer signal (e.g. the client being interrupted) is delivered to the
+// worker thread processing the request as SIGHUP. Waits in the device layer
+// are not interrupted by signals, so the handler wakes a thread that wakes
+// every device's waiters, which then check vuhid_cancelled().
+
+static int signal_pipe[2];
+static pthread_mutex_t devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, device) devices = LIST_HEAD_INITIALIZER(devices);
+
+// Sent with kill(), SIGHUP still terminates the daemon as by default.
+static void
+signal_handler(int sig, siginfo_t* info, void* context)
+{
+    if (info->si_code == SI_USER) {
+        signal(SIGHUP, SIG_DFL);
+        raise(SIGHUP); // once this returns
+        return;
+    }
+    int saved_errno = errno;
+    char c = 0;
+    write(signal_pipe[1], &c, 1); // if the pipe is full, a wakeup is pending
+    errno = saved_errno;
+}
+
 static void*
-worker_run(void* _)
+signal_run(void* _)
 {
-    sigset_t mask;
-    we(sigemptyset(&mask));
-    we(sigaddset(&mask, SIGHUP)); // delivered when peer wants to close the file
-    wp(pthread_sigmask(SIG_BLOCK, &mask, NULL));
-    // Won't get a signal until we start processing, no need for main thread to
-    // wait for this to be in place.
-
-    for (;;)
-        if (cuse_wait_and_process())
-            errx(1, "cuse_wait_and_process() failed");
+    for (;;) {
+        char buf[64];
+        if (!WR(read(signal_pipe[0], buf, sizeof buf)))
+            errx(1, "signal pipe closed");
+        wp(pthread_mutex_lock(&devices_mutex));
+        struct device* d;
+        LIST_FOREACH(d, &devices, vuhid_next)
+            device_wakeup(d);
+        wp(pthread_mutex_unlock(&devices_mutex));
+        mux_wakeup();
+    }
 }
 
 void
@@ -224,10 +401,27 @@ vuhid_start()
     if (!initialized)
         return;
 
-    for (int i = 0; i < 4; i++) {
-        pthread_t worker;
-        wp(pthread_create(&worker, NULL, worker_run, NULL));
-    }
+    we(pipe(signal_pipe));
+    we(fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK));
+    pthread_t thread;
+    wp(pthread_create(&thread, NULL, signal_run, NULL));
+    wp(pthread_detach(thread));
+
+    // Must be in place before any worker can get a signal. Restarting keeps
+    // cuse_wait_and_process() from failing if the signal arrives just after a
+    // request is done.
+    struct sigaction sa = { 0 };
+    sa.sa_sigaction = signal_handler;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    we(sigemptyset(&sa.sa_mask));
+    we(sigaction(SIGHUP, &sa, NULL));
+
+    pool_start(&workers);
+
+    // Not matched by the devd rules for device nodes.
+    if (!cuse_dev_create(&m_methods, NULL, NULL, user, group, mode,
+                         "%smux", name))
+        errx(1, "cuse_dev_create() failed");
 }
 
 void
@@ -253,8 +447,14 @@ vuhid_open(struct device* d)
     if (!d->dev)
         errx(1, "cuse_dev_create() failed");
     char buf[1000];
-    syslog(LOG_NOTICE, "%s%d: %s at %s",
-           name, d->unit, d->model, bt_ntoa(&d->bdaddr, buf));
+    logger_printf(LOG_NOTICE, "%s%d: %s at %s",
+                  name, d->unit, d->model, bt_ntoa(&d->bdaddr, buf));
+
+    wp(pthread_mutex_lock(&devices_mutex));
+    LIST_INSERT_HEAD(&devices, d, vuhid_next);
+    wp(pthread_mutex_unlock(&devices_mutex));
+    mux_attach(d);
+    shm_attach(d);
 }
 
 void
@@ -262,9 +462,14 @@ vuhid_close(struct device* d)
 {
     if (!d->dev)
         return;
+    shm_detach(d);
+    mux_detach(d);
+    wp(pthread_mutex_lock(&devices_mutex));
+    LIST_REMOVE(d, vuhid_next);
+    wp(pthread_mutex_unlock(&devices_mutex));
     cuse_dev_destroy(d->dev);
     cuse_free_unit_number_by_id(d->unit, CUSE_ID_BTSIXAD(0));
-    syslog(LOG_NOTICE, "%s%d detached", name, d->unit);
+    logger_printf(LOG_NOTICE, "%s%d detached", name, d->unit);
     d->unit = -1;
     d->dev = NULL;
 }
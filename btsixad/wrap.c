@@ -1,10 +1,13 @@
 #include "wrap.h"
 
+atomic_ulong wm_allocations;
+
 void*
 wm(void* result)
 {
     if (!result)
         err(1, "malloc() failed");
+    atomic_fetch_add_explicit(&wm_allocations, 1, memory_order_relaxed);
     return result;
 }
 
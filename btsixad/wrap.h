@@ -3,6 +3,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 
 #define WR(f) ({ \
@@ -11,6 +12,10 @@
     if (r == -1) if (errno == EPIPE) r = 0; else err(1, #f); \
     r; })
 
+// Every allocation goes through wm(), so this counts all of them. None should
+// happen per report.
+extern atomic_ulong wm_allocations;
+
 void* wm(void* result);
 void wp(int result);
 void we(int result);
@@ -11,8 +11,28 @@
 #include <dev/usb/usb_ioctl.h>
 #include <dev/usb/usbhid.h>
 
+#include "btsixa.h"
+
 #define W(f) ({ int r = (f); if (r == -1) err(1, #f); r; })
 
+static double
+response_time(int fd, int kind, int id, int size)
+{
+    unsigned char buf[256];
+    struct timespec t0, t1;
+    int n;
+    if (clock_gettime(CLOCK_MONOTONIC, &t0) == -1)
+        err(1, "clock_gettime() failed");
+    for (n = 0; n < 500; n++) {
+        buf[0] = id;
+        if (hid_get_report(fd, kind, buf, size) == -1)
+            err(1, "hid_get_report() failed");
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &t1) == -1)
+        err(1, "clock_gettime() failed");
+    return ((t1.tv_sec-t0.tv_sec) + 1e-9*(t1.tv_nsec-t0.tv_nsec)) / n;
+}
+
 int
 main(int argc, char* argv[]) {
     if (argc != 2)
@@ -125,17 +145,17 @@ main(int argc, char* argv[]) {
     printf("%.2lf Hz / %.3lf ms\n", 1/t, 1000*t);
 
     printf("measuring response time...\n");
-    if (clock_gettime(CLOCK_MONOTONIC, &t0) == -1)
-        err(1, "clock_gettime() failed");
-    for (n = 0; n < 500; n++) {
-        buf[0] = 1;
-        if (hid_get_report(fd, hid_input, buf, sizeof buf) == -1)
-            err(1, "hid_get_report() failed");
-    }
-    if (clock_gettime(CLOCK_MONOTONIC, &t1) == -1)
-        err(1, "clock_gettime() failed");
-    t = ((t1.tv_sec-t0.tv_sec) + 1e-9*(t1.tv_nsec-t0.tv_nsec)) / n;
-    printf("%.3lf ms\n", 1000*t);
+    int cache = 1;
+    if (ioctl(fd, BTSIXA_SET_CACHE, &cache) == -1) // not btsixad
+        printf("%.3lf ms\n", 1000*response_time(fd, hid_input, 1, sizeof buf));
+    else
+        for (; cache >= 0; cache--) {
+            W(ioctl(fd, BTSIXA_SET_CACHE, &cache));
+            printf("%s: input report %.3lf ms, feature report %.3lf ms\n",
+                   cache ? "hit" : "miss",
+                   1000*response_time(fd, hid_input, 1, sizeof buf),
+                   1000*response_time(fd, hid_feature, 0xf2, 17));
+        }
 
     return 0;
 }